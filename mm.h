@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+extern int mm_init (void);
+extern void *mm_malloc (size_t size);
+extern void mm_free (void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/* Returns the free top of the heap to the OS, see mm.c */
+extern int mm_trim(size_t pad);
+extern void mm_set_trim_threshold(size_t bytes);
+
+/* Allocator health, filled in by mm_stats(), see mm.c */
+#define MM_STATS_BUCKETS 32 /* histogram bucket i counts sizes in [2^i, 2^(i+1)) */
+
+struct mm_stats {
+    size_t heap_bytes;        /* bytes obtained from mem_sbrk */
+    size_t released_bytes;    /* heap bytes currently handed back by trimming */
+    size_t slab_bytes;        /* bytes of slab pages carved so far */
+    size_t mapped_bytes;      /* bytes in blocks with their own mapping */
+    size_t peak_mapped_bytes;
+    size_t free_bytes;        /* bytes in free heap blocks */
+    size_t free_blocks;
+    size_t largest_free;      /* size of the largest free heap block */
+    double fragmentation;     /* 1 - largest_free / free_bytes */
+    size_t free_histogram[MM_STATS_BUCKETS];   /* free heap blocks by size */
+
+    /* kept only when mm.c is built with -DMM_STATS */
+    size_t live_bytes;        /* usable bytes of blocks handed out and not freed */
+    size_t peak_live_bytes;
+    size_t live_blocks;
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t fit_searches;      /* find_fit calls */
+    size_t fit_steps;         /* free blocks find_fit inspected */
+    size_t heap_extends;      /* times nothing fit and the heap grew */
+    double fit_seconds;       /* time in find_fit, estimated from a sample */
+    size_t request_histogram[MM_STATS_BUCKETS]; /* mm_malloc requests by size */
+};
+
+extern void mm_stats(struct mm_stats *stats);
+
+/* Arenas: bump allocation with bulk free on top of the heap, see mm.c */
+struct mm_arena;
+
+extern struct mm_arena *mm_arena_create(size_t chunk_size);
+extern void *mm_arena_alloc(struct mm_arena *arena, size_t size);
+extern void mm_arena_reset(struct mm_arena *arena);
+extern void mm_arena_destroy(struct mm_arena *arena);
@@ -0,0 +1,430 @@
+/* mmbench.c
+ *
+ * Trace driven benchmark for the mm.c allocator.
+ * Replays a sequence of malloc/free/realloc requests against mm_malloc,
+ * mm_free and mm_realloc and then against the system malloc, and reports
+ * for each the throughput, the per-request latency percentiles and, for
+ * mm.c, the peak footprint and space utilization. Building mm.c with
+ * -DMM_STATS adds its find_fit search costs to the report.
+ *
+ * Usage:
+ *   ./mmbench [-n ops] [-s seed] <trace file>
+ *   ./mmbench [-n ops] [-s seed] -g <random|lifo|fifo|realloc|small>
+ *
+ * Build alongside the allocator:
+ *   gcc -O2 [-DMM_STATS] -o mmbench mmbench.c mm.c memlib.c
+ *
+ * A trace is a text file with one request per line:
+ *   a <id> <size>   allocate size bytes and call the block id
+ *   f <id>          free block id
+ *   r <id> <size>   reallocate block id to size bytes
+ * Blank lines, lines starting with '#' and lines starting with a number
+ * (the header of the course's .rep traces) are skipped.
+ * With -g a synthetic trace of about ops requests is generated instead.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define DEFAULT_OPS 100000
+#define MAX_LINE 256
+
+struct op {
+    char type; // 'a', 'f' or 'r'
+    int id;
+    size_t size;
+};
+
+struct trace {
+    struct op *ops;
+    int num_ops;
+    int capacity;
+    int num_ids; // ids run from 0 to num_ids - 1
+};
+
+struct allocator {
+    const char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+};
+
+struct result {
+    double seconds; // untimed replay, for throughput
+    long long *latency; // nanoseconds per request, sorted
+    size_t peak_live; // most payload bytes live at once
+};
+
+// forward declarations
+int usage(char *name);
+int read_trace(const char *path, struct trace *trace);
+int generate_trace(const char *pattern, int ops, struct trace *trace);
+void add_op(struct trace *trace, char type, int id, size_t size);
+size_t random_size(size_t lo, size_t hi);
+int replay(struct allocator *alloc, struct trace *trace, struct result *result);
+void report(struct allocator *alloc, struct trace *trace, struct result *result);
+double now(void);
+int compare_latency(const void *a, const void *b);
+int mm_fresh_init(void);
+int libc_init(void);
+
+int usage(char *name)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [-n ops] [-s seed] <trace file>\n", name);
+    fprintf(stderr, "%s [-n ops] [-s seed] -g <random|lifo|fifo|realloc|small>\n", name);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct allocator allocators[] = {
+        { "mm", mm_fresh_init, mm_malloc, mm_free, mm_realloc },
+        { "libc", libc_init, malloc, free, realloc },
+    };
+    struct trace trace = { NULL, 0, 0, 0 };
+    struct result result;
+    const char *pattern = NULL;
+    int ops = DEFAULT_OPS;
+    unsigned int seed = 1;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:s:g:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            pattern = optarg;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    if ((pattern == NULL) == (optind >= argc) || ops <= 0)
+        return usage(argv[0]);
+
+    srand(seed);
+    if (pattern ? generate_trace(pattern, ops, &trace) : read_trace(argv[optind], &trace))
+        return 1;
+
+    printf("trace %s: %d requests over %d ids\n", pattern ? pattern : argv[optind],
+           trace.num_ops, trace.num_ids);
+    printf("%-6s %12s %9s %9s %9s %9s %9s\n", "", "ops/sec", "p50 ns", "p90 ns",
+           "p99 ns", "p99.9 ns", "max ns");
+
+    mem_init();
+    for (i = 0; i < (int)(sizeof(allocators) / sizeof(allocators[0])); i++) {
+        if (replay(&allocators[i], &trace, &result))
+            return 2;
+        report(&allocators[i], &trace, &result);
+        free(result.latency);
+    }
+
+    free(trace.ops);
+    return 0;
+}
+
+/* int replay( struct allocator *alloc, struct trace *trace, struct result *result )
+ * Runs the trace twice against alloc, once untimed to measure throughput
+ * and once timing every request, and touches the first and last byte of
+ * each block handed out so the allocator's pages are really used.
+ * Returns 0 on success or -1 if the allocator fails a request.
+ */
+int replay(struct allocator *alloc, struct trace *trace, struct result *result)
+{
+    void **blocks = calloc(trace->num_ids, sizeof(void *));
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    size_t live = 0;
+    double start;
+    int pass, i;
+
+    result->latency = malloc(trace->num_ops * sizeof(long long));
+    result->peak_live = 0;
+    if (!blocks || !sizes || !result->latency) {
+        perror("replay");
+        return -1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        if (alloc->init() < 0) {
+            fprintf(stderr, "%s: init failed\n", alloc->name);
+            return -1;
+        }
+        memset(blocks, 0, trace->num_ids * sizeof(void *));
+        memset(sizes, 0, trace->num_ids * sizeof(size_t));
+        live = 0;
+        start = now();
+
+        for (i = 0; i < trace->num_ops; i++) {
+            struct op *op = &trace->ops[i];
+            double t = pass ? now() : 0;
+            char *ptr;
+
+            switch (op->type) {
+            case 'a':
+                ptr = alloc->malloc(op->size);
+                break;
+            case 'r':
+                ptr = alloc->realloc(blocks[op->id], op->size);
+                break;
+            default:
+                alloc->free(blocks[op->id]);
+                ptr = NULL;
+                break;
+            }
+            if (pass)
+                result->latency[i] = (long long)((now() - t) * 1e9);
+
+            if (op->type != 'f') {
+                if (!ptr) {
+                    fprintf(stderr, "%s: request %d for %zu bytes failed\n", alloc->name, i, op->size);
+                    return -1;
+                }
+                ptr[0] = 1;
+                ptr[op->size - 1] = 1;
+            }
+
+            live = live - sizes[op->id] + (op->type == 'f' ? 0 : op->size);
+            sizes[op->id] = op->type == 'f' ? 0 : op->size;
+            blocks[op->id] = ptr;
+            if (live > result->peak_live)
+                result->peak_live = live;
+        }
+
+        if (!pass)
+            result->seconds = now() - start;
+    }
+
+    qsort(result->latency, trace->num_ops, sizeof(long long), compare_latency);
+    free(blocks);
+    free(sizes);
+    return 0;
+}
+
+/* void report( struct allocator *alloc, struct trace *trace, struct result *result )
+ * Prints one line of throughput and latency figures, followed for mm.c by
+ * its peak footprint (heap, slab pages and the peak of direct mappings),
+ * the utilization (peak live payload / peak footprint) and, when mm.c
+ * keeps statistics, the average find_fit search.
+ */
+void report(struct allocator *alloc, struct trace *trace, struct result *result)
+{
+    long long *lat = result->latency;
+    long long n = trace->num_ops;
+
+    printf("%-6s %12.0f %9lld %9lld %9lld %9lld %9lld\n", alloc->name,
+           n / result->seconds, lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100],
+           lat[n * 999 / 1000], lat[n - 1]);
+
+    if (alloc->init == mm_fresh_init) {
+        struct mm_stats stats;
+        size_t footprint;
+
+        mm_stats(&stats);
+        footprint = stats.heap_bytes + stats.slab_bytes + stats.peak_mapped_bytes;
+        printf("       peak footprint %zu bytes (heap %zu, slab %zu, mapped %zu), peak live %zu bytes\n",
+               footprint, stats.heap_bytes, stats.slab_bytes, stats.peak_mapped_bytes, result->peak_live);
+        printf("       utilization %.1f%%\n", footprint ? 100.0 * result->peak_live / footprint : 0.0);
+        if (stats.fit_searches)
+            printf("       find_fit: %zu searches, %.2f blocks inspected and %.0f ns each, heap grew %zu times\n",
+                   stats.fit_searches, (double)stats.fit_steps / stats.fit_searches,
+                   stats.fit_seconds * 1e9 / stats.fit_searches, stats.heap_extends);
+    }
+}
+
+/* int read_trace( const char *path, struct trace *trace )
+ * Parses a trace file into trace.
+ * Returns 0 on success or -1 on an unreadable file or malformed line.
+ */
+int read_trace(const char *path, struct trace *trace)
+{
+    char line[MAX_LINE];
+    int line_number = 0;
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char type;
+        int id;
+        size_t size = 0;
+        char *p = line;
+
+        line_number++;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#' || isdigit((unsigned char)*p))
+            continue;
+
+        if (sscanf(p, "%c %d %zu", &type, &id, &size) < 2 || id < 0 ||
+            (type != 'a' && type != 'f' && type != 'r') || (type != 'f' && size == 0)) {
+            fprintf(stderr, "%s:%d: malformed request\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        add_op(trace, type, id, size);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/* int generate_trace( const char *pattern, int ops, struct trace *trace )
+ * Builds a synthetic trace of roughly ops requests. Every block is freed
+ * by the end of the trace.
+ *   random   random mix of requests of 8 bytes to 8 KiB over 2000 ids
+ *   lifo     blocks freed in the reverse order of allocation
+ *   fifo     blocks freed in the order of allocation
+ *   realloc  buffers grown a few hundred bytes at a time, like vectors
+ *   small    churn of 8 to 64 byte nodes, like linked structures
+ * Returns 0 on success or -1 for an unknown pattern.
+ */
+int generate_trace(const char *pattern, int ops, struct trace *trace)
+{
+    int ids, i, j, batch;
+    char *live;
+
+    if (strcmp(pattern, "random") == 0 || strcmp(pattern, "small") == 0) {
+        int small = pattern[0] == 's';
+
+        ids = small ? 10000 : 2000;
+        live = calloc(ids, 1);
+        for (i = 0; i < ops; i++) {
+            j = rand() % ids;
+            if (live[j] && rand() % 4 == 0 && !small) {
+                add_op(trace, 'r', j, random_size(8, 8192));
+            }
+            else if (live[j]) {
+                add_op(trace, 'f', j, 0);
+                live[j] = 0;
+            }
+            else {
+                add_op(trace, 'a', j, small ? random_size(8, 64) : random_size(8, 8192));
+                live[j] = 1;
+            }
+        }
+    }
+    else if (strcmp(pattern, "lifo") == 0 || strcmp(pattern, "fifo") == 0) {
+        int lifo = pattern[0] == 'l';
+
+        ids = 1000;
+        live = calloc(ids, 1);
+        for (i = 0; i < ops; i += 2 * batch) {
+            batch = 1 + rand() % ids;
+            for (j = 0; j < batch; j++)
+                add_op(trace, 'a', j, random_size(8, 4096));
+            for (j = 0; j < batch; j++)
+                add_op(trace, 'f', lifo ? batch - 1 - j : j, 0);
+        }
+    }
+    else if (strcmp(pattern, "realloc") == 0) {
+        size_t *sizes;
+
+        ids = 16;
+        live = calloc(ids, 1);
+        sizes = calloc(ids, sizeof(size_t));
+        for (i = 0; i < ops; i++) {
+            j = rand() % ids;
+            if (live[j] && sizes[j] > 64 * 1024) {
+                add_op(trace, 'f', j, 0);
+                live[j] = 0;
+                sizes[j] = 0;
+            }
+            else {
+                sizes[j] += random_size(16, 512);
+                add_op(trace, live[j] ? 'r' : 'a', j, sizes[j]);
+                live[j] = 1;
+            }
+        }
+        free(sizes);
+    }
+    else {
+        fprintf(stderr, "unknown pattern %s\n", pattern);
+        return -1;
+    }
+
+    for (j = 0; j < ids; j++)
+        if (live[j])
+            add_op(trace, 'f', j, 0);
+    free(live);
+    return 0;
+}
+
+void add_op(struct trace *trace, char type, int id, size_t size)
+{
+    if (trace->num_ops == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : 1024;
+        trace->ops = realloc(trace->ops, trace->capacity * sizeof(struct op));
+        if (!trace->ops) {
+            perror("trace");
+            exit(2);
+        }
+    }
+
+    trace->ops[trace->num_ops].type = type;
+    trace->ops[trace->num_ops].id = id;
+    trace->ops[trace->num_ops].size = size;
+    trace->num_ops++;
+    if (id >= trace->num_ids)
+        trace->num_ids = id + 1;
+}
+
+// picks a power of two range between lo and hi uniformly, then a size inside it,
+// so small requests are as common as large ones
+size_t random_size(size_t lo, size_t hi)
+{
+    int doublings = 0, k;
+    size_t base, span;
+
+    while ((lo << (doublings + 1)) <= hi)
+        doublings++;
+
+    k = rand() % (doublings + 1);
+    base = lo << k;
+    span = (base * 2 <= hi ? base * 2 : hi + 1) - base;
+    return base + (span ? (size_t)rand() % span : 0);
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_latency(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+// each replay starts mm.c from an empty heap
+int mm_fresh_init(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+int libc_init(void)
+{
+    return 0;
+}
@@ -0,0 +1,270 @@
+/* mmtest.c
+ *
+ * Checks for the mm.c allocator. Each check prints one line, and the
+ * exit status is the number of checks that failed.
+ *
+ * Usage:
+ *   ./mmtest
+ *
+ * Build alongside the allocator, with the same flags it is built with:
+ *   gcc -O2 [-DMM_STATS] [-DMM_THREADS -pthread] -o mmtest mmtest.c mm.c memlib.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+// forward declarations
+int check(const char *name, int passed);
+int check_calloc_overflow(void);
+int check_memalign_huge(void);
+int check_memalign(void);
+int check_realloc_in_place(void);
+int check_trim(void);
+int check_stats_counters(void);
+int check_arena_reset(void);
+
+int main(void)
+{
+    int failed = 0;
+
+    mem_init();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        return 1;
+    }
+
+    failed += check_calloc_overflow();
+    failed += check_memalign_huge();
+    failed += check_memalign();
+    failed += check_realloc_in_place();
+    failed += check_trim();
+    failed += check_stats_counters();
+    failed += check_arena_reset();
+
+    return failed;
+}
+
+// prints the outcome of one check, returns 1 if it failed
+int check(const char *name, int passed)
+{
+    printf("%-4s %s\n", passed ? "ok" : "FAIL", name);
+    return !passed;
+}
+
+/*
+ * mm_calloc must return NULL when nmemb * size overflows, and also when
+ * the product fits in a size_t but is too large to round up to whole
+ * pages, instead of a small block of the wrapped size.
+ */
+int check_calloc_overflow(void)
+{
+    int failed = 0;
+    char *small;
+
+    failed += check("calloc(1, SIZE_MAX - 10) returns NULL", mm_calloc(1, SIZE_MAX - 10) == NULL);
+    failed += check("calloc(SIZE_MAX - 10, 1) returns NULL", mm_calloc(SIZE_MAX - 10, 1) == NULL);
+    failed += check("calloc(2, SIZE_MAX / 2 + 1) returns NULL", mm_calloc(2, SIZE_MAX / 2 + 1) == NULL);
+
+    small = mm_calloc(16, 16);
+    failed += check("calloc(16, 16) still returns zeroed memory",
+                    small && small[0] == 0 && small[255] == 0);
+    mm_free(small);
+    return failed;
+}
+
+/*
+ * A block's header word has no room for an alignment of 4 GiB or more, so
+ * mm_memalign must refuse one instead of handing out a broken block. An
+ * alignment just past a page still has to work.
+ */
+int check_memalign_huge(void)
+{
+    int failed = 0;
+    char *ptr;
+
+    failed += check("memalign(1 << 32, 100) returns NULL", mm_memalign(1UL << 32, 100) == NULL);
+    failed += check("memalign(1 << 63, 100) returns NULL", mm_memalign(1UL << 63, 100) == NULL);
+
+    ptr = mm_memalign(1 << 16, 100);
+    failed += check("memalign(1 << 16, 100) is aligned", ptr && ((uintptr_t)ptr & 0xffff) == 0);
+    if (ptr) {
+        memset(ptr, 0xab, 100);
+    }
+    mm_free(ptr);
+    return failed;
+}
+
+/*
+ * Every power of two alignment, from the heap path up to the mapped one,
+ * must come back aligned and fully writable.
+ */
+int check_memalign(void)
+{
+    int failed = 0;
+    size_t alignment;
+    char name[64];
+    char *ptr;
+
+    for (alignment = 16; alignment <= 8192; alignment *= 2) {
+        ptr = mm_memalign(alignment, 300);
+        snprintf(name, sizeof(name), "memalign(%zu, 300) is aligned", alignment);
+        failed += check(name, ptr && ((uintptr_t)ptr & (alignment - 1)) == 0);
+        if (ptr) {
+            memset(ptr, 0xcd, 300);
+        }
+        mm_free(ptr);
+    }
+    return failed;
+}
+
+/*
+ * A block followed by a free block that is large enough must grow into it
+ * and keep its address, with its contents untouched.
+ */
+int check_realloc_in_place(void)
+{
+    int failed = 0;
+    char *ptr, *next, *guard, *grown;
+
+    ptr = mm_malloc(1000);
+    next = mm_malloc(4000);
+    guard = mm_malloc(1000);
+    if (!ptr || !next || !guard) {
+        return check("realloc grows in place (allocation failed)", 0);
+    }
+    memset(ptr, 0x5a, 1000);
+    mm_free(next);
+
+    grown = mm_realloc(ptr, 3000);
+    failed += check("realloc into a free neighbor keeps the address", grown == ptr);
+    failed += check("realloc into a free neighbor keeps the contents",
+                    grown && grown[0] == 0x5a && grown[999] == 0x5a);
+    if (grown) {
+        memset(grown, 0x5a, 3000);
+    }
+    mm_free(grown ? grown : ptr);
+    mm_free(guard);
+    return failed;
+}
+
+/*
+ * Freeing a large tail of the heap and calling mm_trim must release its
+ * pages, and mm_stats must report them as released.
+ */
+int check_trim(void)
+{
+    int failed = 0;
+    struct mm_stats before, after;
+    char *blocks[8];
+    int i;
+
+    mm_set_trim_threshold((size_t)-1);
+    for (i = 0; i < 8; i++) {
+        blocks[i] = mm_malloc(100 * 1024);
+        if (blocks[i]) {
+            memset(blocks[i], 1, 100 * 1024);
+        }
+    }
+    for (i = 7; i >= 0; i--) {
+        mm_free(blocks[i]);
+    }
+
+    mm_stats(&before);
+    failed += check("mm_trim(0) releases a free heap tail", mm_trim(0) == 1);
+    mm_stats(&after);
+    failed += check("mm_stats counts the trimmed bytes",
+                    after.released_bytes >= before.released_bytes + 512 * 1024);
+    failed += check("mm_trim(0) has nothing left to release", mm_trim(0) == 0);
+
+    // the released pages are handed out again, zero or not, and must be usable
+    blocks[0] = mm_malloc(400 * 1024 - 64);
+    failed += check("memory reused after a trim is writable", blocks[0] != NULL);
+    if (blocks[0]) {
+        memset(blocks[0], 2, 400 * 1024 - 64);
+    }
+    mm_free(blocks[0]);
+    mm_set_trim_threshold(256 * 1024);
+    return failed;
+}
+
+/*
+ * With -DMM_STATS the request counters follow every call, without it they
+ * must read as zero.
+ */
+int check_stats_counters(void)
+{
+    int failed = 0;
+    struct mm_stats before, after;
+    void *a, *b;
+
+    mm_stats(&before);
+    a = mm_malloc(100);
+    b = mm_malloc(5000);
+    b = mm_realloc(b, 6000);
+    mm_stats(&after);
+#ifdef MM_STATS
+    failed += check("stats count mallocs", after.mallocs == before.mallocs + 2);
+    failed += check("stats count reallocs", after.reallocs == before.reallocs + 1);
+    failed += check("stats count live blocks", after.live_blocks == before.live_blocks + 2);
+    failed += check("stats count live bytes", after.live_bytes >= before.live_bytes + 6100);
+#else
+    failed += check("stats counters read zero without MM_STATS",
+                    after.mallocs == 0 && after.reallocs == 0 && after.live_bytes == 0);
+#endif
+
+    mm_free(a);
+    mm_free(b);
+    mm_stats(&after);
+#ifdef MM_STATS
+    failed += check("stats count frees", after.frees == before.frees + 2);
+    failed += check("stats live blocks return to where they were", after.live_blocks == before.live_blocks);
+#else
+    failed += check("stats frees read zero without MM_STATS", after.frees == 0);
+#endif
+    return failed;
+}
+
+/*
+ * mm_arena_reset must hand back everything but the first chunk, so the
+ * next allocation starts over at the same address and cycles of fill and
+ * reset do not grow the heap.
+ */
+int check_arena_reset(void)
+{
+    int failed = 0;
+    struct mm_arena *arena;
+    struct mm_stats before, after;
+    char *first, *ptr;
+    int round, i;
+
+    arena = mm_arena_create(4096);
+    if (!arena) {
+        return check("arena create", 0);
+    }
+
+    first = mm_arena_alloc(arena, 64);
+    for (round = 0; round < 2; round++) {
+        if (round == 1) {
+            mm_stats(&before);
+        }
+        for (i = 0; i < 200; i++) {
+            ptr = mm_arena_alloc(arena, i % 4 ? 100 : 3000);
+            if (ptr) {
+                memset(ptr, i, i % 4 ? 100 : 3000);
+            }
+        }
+        mm_arena_reset(arena);
+        ptr = mm_arena_alloc(arena, 64);
+        failed += check("arena reset starts over in the first chunk", ptr == first);
+    }
+    mm_stats(&after);
+    failed += check("arena fill and reset cycles do not grow the heap",
+                    after.heap_bytes == before.heap_bytes);
+
+    mm_arena_destroy(arena);
+    return failed;
+}
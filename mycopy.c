@@ -1,4 +1,4 @@
-// mycopy.c 
+// mycopy.c
 // Author : Murtaza Meerza
 // I collaborated along side Xavier Sepulveda and we exchanged ideas back and forth.
 
@@ -6,19 +6,286 @@
  * makes a copy of a file and assigns the same file
  * permissions to the copy
  * Usage:
- *   ./mycopy <name of original file> <name of copy>
+ *   ./mycopy [-j threads] <name of original file> <name of copy>
+ *   ./mycopy -r [-j threads] <original directory> <name of copy>
+ *   ./mycopy -a [-d] ... to pipeline reads and writes
+ *   ./mycopy -v|-V ... to checksum the data as it is copied
+ *   ./mycopy -u ... to bring an existing copy up to date
+ *   ./mycopy -c ... to make a copy that can be resumed
+ *   ./mycopy -s [-b size] [-m method] ... to measure a copy
+ *   ./mycopy -f <manifest> [-j threads] to copy a list of files
  * If the original file does not exist or the user
  * lacks permission to read it, mycopy emits an error.
  * Also, if a file or directory exists with the name
  * proposed for the copy, mycopy emits an error and
- * terminates.
+ * terminates, unless -u is given.
+ *
+ * The data is copied inside the kernel where possible:
+ * first by cloning the file (a reflink, on filesystems
+ * that share extents such as btrfs and xfs), then with
+ * copy_file_range, then with sendfile, and only then
+ * through a buffer with read and write. A method that
+ * turns out unsupported is given up for that file only,
+ * so with -r or -f one pipe or cross-device copy does not
+ * slow down the files after it.
+ *
+ * Holes in a sparse original are not read at all: only
+ * the data extents found with SEEK_DATA and SEEK_HOLE
+ * are copied, so the copy has the same holes.
+ *
+ * With -j, a large file is cut into RANGE_SIZE pieces that
+ * that many threads copy at once with positional I/O, into
+ * a copy that was given its full length (and, unless the
+ * original is sparse, its blocks) before the first write.
+ * Build with -pthread.
+ *
+ * With -r, a whole directory tree is copied by a pool of
+ * threads (-j, or one per CPU). Every directory and file
+ * becomes a task. Each thread keeps its own deque of tasks,
+ * works from its back and, when it runs dry, steals from the
+ * front of another thread's deque, so one huge directory is
+ * spread over all threads. Symbolic links are recreated,
+ * other special files are skipped with a warning.
+ *
+ * With -a, data moves through ASYNC_DEPTH buffers kept in
+ * flight at once, so the read of one block overlaps the
+ * write of another, which pays off between two devices.
+ * Requests go through io_uring, driven with raw system calls,
+ * or through a reader thread where io_uring is unavailable.
+ * -d adds O_DIRECT (and implies -a) on filesystems that
+ * allow it, bypassing the page cache with aligned buffers;
+ * -b must then be a multiple of DIRECT_ALIGN.
+ *
+ * With -v, every block is checksummed (CRC32C, with the
+ * SSE4.2 crc32 instruction when the CPU has it) while it is
+ * in our buffers, and the file's checksum is printed. Blocks
+ * arrive in any order from -j and -a, so each one adds its
+ * CRC shifted by the bytes that follow it in the file, and
+ * holes add nothing. -V then reads the copy back from disk
+ * and exits with 3 if it does not match. Both skip the
+ * in-kernel copy methods, which never show us the data.
+ *
+ * With -u, a copy that already exists is updated in place:
+ * both files are read and only the DELTA_BLOCK sized blocks
+ * that differ are written, holes in the original are punched
+ * into the copy and the copy is cut to the original's length.
+ * A copy that is mostly current then costs reads, not writes.
+ *
+ * With -c, a file is copied in CHECKPOINT_SIZE steps and,
+ * once each step is on disk, the offset reached and a CRC32C
+ * of the block just before it are saved in <copy>.checkpoint.
+ * Running the same command after an interruption continues
+ * from there, provided the original has kept its size and
+ * modification time and the copy still ends in that block.
+ * Steps are copied by one thread; the checkpoint is removed
+ * when the copy completes.
+ *
+ * With -s, every read, write, in-kernel copy and wait on
+ * io_uring is counted and timed, with the bytes it moved, and
+ * a summary goes to stderr at the end (times are summed over
+ * threads; io_uring requests count as reads and writes, but
+ * their time is the wait). On a terminal, the bytes written
+ * so far and the rate are shown once a second. -b sets the
+ * buffer size of read and write copies and -m forces a copy
+ * method: range (copy_file_range), sendfile or read (read
+ * and write), none of which tries a clone first.
+ * mycopy_bench.sh compares these across file sizes.
+ *
+ * With -f, many files are copied by one process: each line
+ * of the manifest (- for stdin) holds an original and the
+ * name of its copy, separated by a tab. The files become
+ * tasks for the pool -r uses, whose threads keep their
+ * buffers from one file to the next. Every copy costs few
+ * system calls: it is created with the original's mode, so
+ * fchmod is only needed when the umask got in the way, a
+ * filesystem that cannot clone is not asked again, and a
+ * dense file is copied without looking for holes.
  */
 
+#define _GNU_SOURCE // for copy_file_range
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/fs.h> // FICLONE
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define BUFFER_SIZE 4194304 // default size of the buffer, mycopy_bench.sh tries others with -b
+#define CHUNK_SIZE (1 << 30) // most bytes handed to the kernel in one copy call
+#define RANGE_SIZE (64 << 20) // bytes a thread claims at a time with -j
+#define MAX_THREADS 64
+#define ASYNC_BLOCK (1 << 20) // bytes per buffer with -a
+#define ASYNC_DEPTH 8 // buffers in flight with -a
+#define DIRECT_ALIGN 4096 // buffer, offset and length alignment O_DIRECT needs
+#define ROUND_UP(n, align) (((n) + (align) - 1) & ~(off_t)((align) - 1))
+#define CRC32C_POLY 0x82f63b78 // Castagnoli polynomial, bit reversed
+#define DELTA_BLOCK 65536 // -u rewrites blocks of this size that differ
+#define CHECKPOINT_SIZE (256<<20) // -c saves its progress this often
+#define CHECKPOINT_BLOCK (1<<20) // and checks this much of the copy before resuming
+
+// copy methods, from fastest to slowest
+enum { COPY_FILE_RANGE, COPY_SENDFILE, COPY_BUFFERED };
+int copy_method = COPY_FILE_RANGE; // the fastest method to try, set with -m
+int threads = 1; // set with -j
+int recursive = 0; // set with -r
+int async = 0; // set with -a
+int direct = 0; // set with -d
+int verify = 0; // 1 with -v, 2 with -V
+int update = 0; // set with -u
+int resumable = 0; // set with -c
+int try_clone = 1; // cleared by -m, never by a failed clone
+size_t buffer_size = BUFFER_SIZE; // set with -b
+int show_stats = 0; // set with -s
+mode_t creation_mask; // the umask, which open applies to new copies
+
+// what -s counts
+enum { STAT_READ, STAT_WRITE, STAT_KERNEL, STAT_RING, STAT_KINDS };
+char * stat_names[STAT_KINDS] = { "read", "write", "in-kernel copy", "io_uring wait" };
+
+struct stats {
+    long long calls[STAT_KINDS];
+    long long bytes[STAT_KINDS];
+    long long nanoseconds[STAT_KINDS];
+    long long files; // copied without error
+    long long start; // when mycopy started
+    long long shown; // when progress was last shown, 0 if never
+    int terminal; // stderr shows progress
+} stats;
+
+// CRC32C of a file being copied with -v
+struct checksum {
+    off_t size;
+    uint32_t crc; // XOR of every block's CRC shifted to the end of the file
+};
+
+__thread struct checksum * checksum; // the file this thread is copying, NULL unless verifying
+__thread int delta; // the copy this thread writes already holds data, set with -u
+__thread char * copy_buffer; // copy_buffered's buffer, set up on first use and kept
+__thread int file_method; // copy_method for the file this thread copies, drops once one turns out unsupported
+
+// progress of a copy made with -c, kept in a file beside the copy
+struct checkpoint {
+    int fd; // the checkpoint file
+    off_t offset; // everything before it is on disk in the copy
+    uint32_t crc; // CRC32C of the CHECKPOINT_BLOCK bytes of the copy before offset
+};
+
+__thread struct checkpoint * progress; // NULL unless this thread copies with -c
+uint32_t crc_table[8][256]; // slicing by 8, for CPUs without the crc32 instruction
+uint32_t crc_powers[64]; // x^(2^k) modulo the polynomial
+int crc_hardware;
+
+// a file being copied by several threads
+struct parallel_copy {
+    int in;
+    int out;
+    off_t size;
+    off_t next; // start of the first range no thread has claimed
+    int err; // errno of the first failure, 0 while all is well
+    struct checksum * sum;
+    int delta;
+    int method;
+};
+
+// an io_uring instance, its rings mapped into our memory
+struct ring {
+    int fd;
+    char * sq; // the three mappings, kept to unmap them
+    char * cq;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned to_submit; // queued entries the kernel has not been told about
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+};
+
+// one buffer of the -a pipeline and the block it holds
+struct slot {
+    char * buffer;
+    off_t offset;
+    size_t length; // bytes of the block to copy
+    size_t size; // bytes to write, length rounded up to DIRECT_ALIGN with -d
+    size_t done; // bytes of the block read so far, then bytes of size written
+    int writing;
+};
+
+// the reader thread fallback of -a, the reader fills slots that the caller empties in order
+struct pipeline {
+    int in;
+    off_t next;
+    off_t end;
+    struct slot slots[ASYNC_DEPTH];
+    int head; // oldest filled slot
+    int count; // filled slots
+    int finished; // the reader stopped
+    int err;
+    struct checksum * sum;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+__thread int ring_state = 0; // 1 once this thread has a ring, -1 if io_uring is unavailable
+__thread struct ring ring;
+__thread char * async_buffers; // ASYNC_DEPTH blocks, aligned for O_DIRECT
+
+// a directory or file waiting to be copied with -r
+struct task {
+    char * from;
+    char * to;
+    int is_dir;
+};
+
+// one pool thread's tasks, live between head and tail
+struct deque {
+    pthread_mutex_t lock;
+    struct task ** tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+// a directory whose permissions are set once its contents are copied
+struct late_mode {
+    struct late_mode * next;
+    char * path;
+    mode_t mode;
+};
+
+// the thread pool of -r
+struct pool {
+    struct deque queues[MAX_THREADS];
+    int workers;
+    size_t pending; // tasks created and not finished yet
+    long queued; // tasks sitting in a deque, briefly -1 when a task is taken before its push is counted
+    int failures;
+    pthread_mutex_t idle_lock; // idle threads sleep on idle until work shows up or all is done
+    pthread_cond_t idle;
+    pthread_mutex_t late_lock;
+    struct late_mode * late_modes;
+};
+struct pool pool;
 
 int error( char * msg )
 {
@@ -28,55 +295,1489 @@ int error( char * msg )
 
 int usage( char * name )
 {
-    printf( "Usage: %s <file to copy> <name of copy>\n", name );
+    printf( "Usage: %s [-r] [-a] [-d] [-v|-V] [-u] [-c] [-s] [-b size] [-m range|sendfile|read] [-j threads] <file to copy> <name of copy>\n", name );
+    printf( "       %s -f <manifest of file to copy TAB name of copy lines, - for stdin> [options]\n", name );
     return 1;
 }
 
-int main(int argc, char * argv[])
+// true for the errors a copy method gives when the files or kernel do not support it
+int unsupported( int err )
 {
-    if (argc != 3)
-        return usage(argv[0]);
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ESPIPE;
+}
+
+// parses a size such as 65536, 64k or 4m, returns 0 if it is not one
+size_t parse_size( char * text )
+{
+    char * end;
+    unsigned long long size = strtoull(text, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+        size <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20;
+    else if (*end == 'g' || *end == 'G')
+        size <<= 30;
+    else
+        end--;
+    return end[1] || end + 1 == text ? 0 : size;
+}
+
+// the monotonic clock in nanoseconds, or 0 when -s is off
+long long stat_clock( void )
+{
+    struct timespec now;
+
+    if (!show_stats)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Counts a call of the given kind with -s. It began at
+ * start (0 for nothing to time) and returned result, a byte
+ * count or -1. Shows progress when a second has passed.
+ */
+void stat_count( int kind, long long start, ssize_t result )
+{
+    long long now;
+    long long shown;
+    long long written;
+
+    if (!show_stats)
+        return;
+    now = stat_clock();
+    __atomic_add_fetch(&stats.calls[kind], 1, __ATOMIC_RELAXED);
+    if (result > 0)
+        __atomic_add_fetch(&stats.bytes[kind], result, __ATOMIC_RELAXED);
+    if (start)
+        __atomic_add_fetch(&stats.nanoseconds[kind], now - start, __ATOMIC_RELAXED);
+
+    shown = __atomic_load_n(&stats.shown, __ATOMIC_RELAXED);
+    if (!stats.terminal || now - (shown ? shown : stats.start) < 1000000000LL
+        || !__atomic_compare_exchange_n(&stats.shown, &shown, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    written = __atomic_load_n(&stats.bytes[STAT_WRITE], __ATOMIC_RELAXED)
+            + __atomic_load_n(&stats.bytes[STAT_KERNEL], __ATOMIC_RELAXED);
+    fprintf(stderr, "\r%lld MiB written, %.1f MiB/s ", written >> 20,
+            written / 1048576.0 / ((now - stats.start) / 1e9));
+}
+
+// prints what -s counted
+void stat_report( void )
+{
+    double elapsed = (stat_clock() - stats.start) / 1e9;
+    long long written = stats.bytes[STAT_WRITE] + stats.bytes[STAT_KERNEL];
+    int kind;
+
+    fprintf(stderr, "%s%lld files, %lld bytes written in %.3f s, %.1f MiB/s\n",
+            stats.shown ? "\n" : "", stats.files, written, elapsed,
+            elapsed > 0 ? written / 1048576.0 / elapsed : 0);
+    for (kind = 0; kind < STAT_KINDS; kind++)
+        if (stats.calls[kind])
+            fprintf(stderr, "  %-15s %10lld calls %15lld bytes %10.3f s\n", stat_names[kind],
+                    stats.calls[kind], stats.bytes[kind], stats.nanoseconds[kind] / 1e9);
+}
+
+// a * b modulo the CRC polynomial, both bit reversed like the CRC itself
+uint32_t crc_multiply( uint32_t a, uint32_t b )
+{
+    uint32_t product = 0;
+    uint32_t bit;
+
+    for (bit = 1u << 31; bit; bit >>= 1) {
+        if (a & bit)
+            product ^= b;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// crc as if length zero bytes followed the data it covers
+uint32_t crc_shift( uint32_t crc, uint64_t length )
+{
+    int k;
+
+    for (k = 3; length; length >>= 1, k++) // x^(8 * length), one power per bit of length
+        if (length & 1)
+            crc = crc_multiply(crc_powers[k], crc);
+    return crc;
+}
+
+void crc_init( void )
+{
+    uint32_t crc;
+    int i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+
+    crc_powers[0] = 1u << 30; // x^1
+    for (i = 1; i < 64; i++)
+        crc_powers[i] = crc_multiply(crc_powers[i - 1], crc_powers[i - 1]);
+
+#if defined(__x86_64__)
+    crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc_sse42( uint32_t crc, const unsigned char * data, size_t length )
+{
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; data += 8, length -= 8)
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)data);
+    crc = crc64;
+    for (; length; data++, length--)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#endif
+
+// CRC32C of data with no initial or final inversion
+uint32_t crc32c( uint32_t crc, const unsigned char * data, size_t length )
+{
+    uint64_t word;
+
+#if defined(__x86_64__)
+    if (crc_hardware)
+        return crc_sse42(crc, data, length);
+#endif
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        word ^= crc; // little endian, like the crc32 instruction
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff]
+            ^ crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff]
+            ^ crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff]
+            ^ crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+    }
+    for (; length; data++, length--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data) & 0xff];
+    return crc;
+}
+
+// adds the block at offset to the checksum of the file this thread copies
+void checksum_block( const char * data, size_t length, off_t offset )
+{
+    uint32_t crc;
+
+    if (!checksum || offset >= checksum->size)
+        return;
+    if (offset + (off_t)length > checksum->size)
+        length = checksum->size - offset;
+    crc = crc32c(0, (const unsigned char *)data, length);
+    crc = crc_shift(crc, checksum->size - offset - length);
+    __atomic_fetch_xor(&checksum->crc, crc, __ATOMIC_RELAXED);
+}
+
+// the usual CRC32C, with its initial and final inversion, of a whole file
+uint32_t checksum_value( struct checksum * sum )
+{
+    return sum->crc ^ crc_shift(0xffffffff, sum->size) ^ 0xffffffff;
+}
+
+/* Adds the data extents of the file fd before end to the
+ * checksum sum. Returns 0, or -1 with errno set.
+ */
+int checksum_file( int fd, struct checksum * sum, off_t end )
+{
+    struct checksum * copying = checksum;
+    char * buffer;
+    off_t offset = 0;
+    off_t data;
+    off_t hole;
+    off_t length;
+    ssize_t bytes_read;
+
+    long long start;
+
+    if (posix_memalign((void **)&buffer, DIRECT_ALIGN, buffer_size) != 0)
+        return -1;
+
+    checksum = sum;
+    while (offset < end) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break;
+        hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            if (errno != EINVAL || offset != 0)
+                break;
+            data = 0; // a kernel without SEEK_DATA
+            hole = end;
+        }
+        if (hole > end)
+            hole = end;
+        for (offset = data; offset < hole; offset += bytes_read) {
+            length = hole - offset < (off_t)buffer_size ? hole - offset : (off_t)buffer_size;
+            start = stat_clock();
+            // O_DIRECT reads whole blocks, so the tail of the file is read up to one and cut back
+            bytes_read = pread(fd, buffer, direct ? ROUND_UP(length, DIRECT_ALIGN) : length, offset);
+            stat_count(STAT_READ, start, bytes_read);
+            if (bytes_read <= 0)
+                break;
+            if (bytes_read > length)
+                bytes_read = length;
+            checksum_block(buffer, bytes_read, offset);
+        }
+        if (offset < hole)
+            break;
+    }
+    checksum = copying;
+    free(buffer);
+    return offset < end && errno != ENXIO ? -1 : 0;
+}
+
+// CRC32C of the CHECKPOINT_BLOCK bytes of fd before offset, or -1
+int64_t checkpoint_crc( int fd, off_t offset )
+{
+    char * buffer;
+    off_t start = offset > CHECKPOINT_BLOCK ? offset - CHECKPOINT_BLOCK : 0;
+    ssize_t bytes_read;
+    int64_t crc;
+    long long began = stat_clock();
+
+    if (posix_memalign((void **)&buffer, DIRECT_ALIGN, CHECKPOINT_BLOCK) != 0)
+        return -1;
+    bytes_read = pread(fd, buffer, offset - start, start);
+    stat_count(STAT_READ, began, bytes_read);
+    crc = bytes_read == offset - start ? (int64_t)crc32c(0, (unsigned char *)buffer, bytes_read) : -1;
+    free(buffer);
+    return crc;
+}
+
+/* Reads the checkpoint an interrupted copy of the file st
+ * describes left behind, and checks it against the copy out.
+ * Returns the offset to resume at, 0 to start over.
+ */
+off_t checkpoint_load( struct checkpoint * saved, struct stat * st, int out )
+{
+    char line[128];
+    long long offset;
+    unsigned crc;
+    long long size;
+    long long mtime;
+    long mtime_nsec;
+    ssize_t length = pread(saved->fd, line, sizeof(line) - 1, 0);
+
+    if (length <= 0)
+        return 0;
+    line[length] = '\0';
+    if (sscanf(line, "mycopy checkpoint %lld %x %lld %lld.%ld", &offset, &crc, &size, &mtime, &mtime_nsec) != 5
+        || size != st->st_size || mtime != st->st_mtim.tv_sec || mtime_nsec != st->st_mtim.tv_nsec
+        || offset <= 0 || offset > size)
+        return 0; // the original changed, so the copied part may be stale
+    if (checkpoint_crc(out, offset) != crc)
+        return 0; // the copy changed or lost its last block
+    saved->crc = crc;
+    return offset;
+}
+
+/* Records that out, a copy of the file st describes, is
+ * complete up to offset, once that data is safely on disk.
+ * Returns 0, or -1 with errno set.
+ */
+int checkpoint_save( struct checkpoint * saved, struct stat * st, int out, off_t offset )
+{
+    char line[128];
+    int64_t crc;
+    int length;
+
+    // the checkpoint must never get ahead of the data
+    if (fdatasync(out) == -1 || (crc = checkpoint_crc(out, offset)) == -1)
+        return -1;
+    // fixed width fields, so each save overwrites the last one whole
+    length = snprintf(line, sizeof(line), "mycopy checkpoint %020lld %08x %020lld %020lld.%09ld\n",
+                      (long long)offset, (unsigned)crc, (long long)st->st_size,
+                      (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+    if (pwrite(saved->fd, line, length, 0) != length || fdatasync(saved->fd) == -1)
+        return -1;
+    saved->offset = offset;
+    saved->crc = crc;
+    return 0;
+}
+
+// copies up to length bytes at offset through a buffer, returns bytes copied or -1
+ssize_t copy_buffered( int in, int out, off_t offset, size_t length )
+{
+    size_t size = length < buffer_size ? length : buffer_size;
+    char * buffer = copy_buffer;
+    ssize_t bytes_read_in;
+    ssize_t written = 0;
+    ssize_t bytes_written;
+    long long start;
+
+    if (!buffer && (buffer = copy_buffer = malloc(buffer_size)) == NULL)
+        return -1;
+
+    start = stat_clock();
+    bytes_read_in = pread(in, buffer, size, offset);
+    if (bytes_read_in == -1 && errno == ESPIPE)
+        bytes_read_in = read(in, buffer, size); // pipes have no offsets
+    stat_count(STAT_READ, start, bytes_read_in);
+    if (bytes_read_in > 0)
+        checksum_block(buffer, bytes_read_in, offset);
+
+    while (written < bytes_read_in) {
+        start = stat_clock();
+        bytes_written = pwrite(out, buffer + written, bytes_read_in - written, offset + written);
+        stat_count(STAT_WRITE, start, bytes_written);
+        if (bytes_written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += bytes_written;
+    }
+    return bytes_read_in;
+}
+
+/* Copies length bytes at offset onto a copy that already has
+ * data there, writing only the DELTA_BLOCK sized blocks whose
+ * bytes differ. Returns 0, or -1 with errno set.
+ */
+int copy_delta( int in, int out, off_t offset, off_t length )
+{
+    char * buffer;
+    char * old;
+    ssize_t bytes_read;
+    ssize_t old_read;
+    ssize_t block;
+    ssize_t size;
+    ssize_t written;
+    ssize_t bytes_written;
+    int status = 0;
+    long long start;
+
+    if ((errno = posix_memalign((void **)&buffer, DIRECT_ALIGN, 2 * buffer_size)) != 0)
+        return -1;
+    old = buffer + buffer_size;
+
+    while (length > 0 && status == 0) {
+        size = length < (off_t)buffer_size ? length : (off_t)buffer_size;
+        start = stat_clock();
+        bytes_read = pread(in, buffer, size, offset);
+        stat_count(STAT_READ, start, bytes_read);
+        old_read = 0;
+        if (bytes_read > 0) {
+            start = stat_clock();
+            old_read = pread(out, old, bytes_read, offset);
+            stat_count(STAT_READ, start, old_read);
+        }
+        if (bytes_read <= 0 || old_read == -1) {
+            status = bytes_read == 0 ? 0 : -1;
+            break;
+        }
+        checksum_block(buffer, bytes_read, offset);
+
+        for (block = 0; block < bytes_read && status == 0; block += DELTA_BLOCK) {
+            size = bytes_read - block < DELTA_BLOCK ? bytes_read - block : DELTA_BLOCK;
+            if (block + size <= old_read && memcmp(buffer + block, old + block, size) == 0)
+                continue;
+            for (written = 0; written < size; written += bytes_written) {
+                start = stat_clock();
+                bytes_written = pwrite(out, buffer + block + written, size - written,
+                                       offset + block + written);
+                stat_count(STAT_WRITE, start, bytes_written);
+                if (bytes_written == -1) {
+                    if (errno != EINTR) {
+                        status = -1;
+                        break;
+                    }
+                    bytes_written = 0;
+                }
+            }
+        }
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    free(buffer);
+    return status;
+}
+
+// true when the ring fd runs the reads and writes copy_uring queues
+int ring_supported( int fd )
+{
+    struct io_uring_probe * probe;
+    int supported;
+
+    probe = calloc(1, sizeof(*probe) + (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op));
+    if (!probe)
+        return 0;
+    supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_WRITE + 1) == 0
+        && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// unmaps the rings ring_init mapped, even a partial set, and closes the ring
+void ring_exit( struct ring * ring )
+{
+    if (ring->sq != MAP_FAILED)
+        munmap(ring->sq, ring->sq_size);
+    if (ring->cq != MAP_FAILED)
+        munmap(ring->cq, ring->cq_size);
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+}
+
+/* Sets up an io_uring with room for entries requests and maps
+ * its rings. Returns 0, or -1 with errno set.
+ */
+int ring_init( struct ring * ring, unsigned entries )
+{
+    struct io_uring_params params;
+    char * sq;
+    char * cq;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
+    // kernels before 5.6 set up a ring but fail every read and write on it, and cannot be probed
+    if (!ring_supported(ring->fd)) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq = ring->sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    cq = ring->cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring_exit(ring);
+        return -1;
+    }
+
+    ring->to_submit = 0;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// queues a read or write of length bytes at offset, tagged with the slot it is for
+void ring_queue( struct ring * ring, int opcode, int fd, char * buffer, size_t length, off_t offset, int slot )
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE); // the kernel may see the entry now
+    ring->to_submit++;
+}
+
+// submits what is queued and takes the next completion, returns 0 or -1
+int ring_wait( struct ring * ring, struct io_uring_cqe * cqe )
+{
+    unsigned head;
+    long submitted;
+    long long start;
+
+    for (;;) {
+        head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        start = stat_clock();
+        submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        stat_count(STAT_RING, start, 0);
+        if (submitted == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->to_submit -= submitted;
+    }
+}
+
+// points slot at the next block of the range and sizes it for reading
+void slot_next( struct slot * slot, off_t * next, off_t end )
+{
+    slot->offset = *next;
+    slot->length = end - *next < ASYNC_BLOCK ? end - *next : ASYNC_BLOCK;
+    slot->size = direct ? ROUND_UP(slot->length, DIRECT_ALIGN) : slot->length;
+    slot->done = 0;
+    slot->writing = 0;
+    *next += slot->length;
+}
+
+/* A read of the rest of the block in slot returned bytes_read
+ * bytes. Only EOF or the whole block ends the reading, a read
+ * can fall short anywhere else. Returns 1 when slot_filled()
+ * can take the block, 0 when the rest must be read again.
+ */
+int slot_read( struct slot * slot, ssize_t bytes_read )
+{
+    slot->done += bytes_read;
+    return bytes_read == 0 || slot->done >= slot->length;
+}
+
+/* A block was read into slot, bytes_read of it before EOF.
+ * Trims the block to what exists and, with -d, pads it with
+ * zeros to whole blocks, which copy_data truncates away.
+ * Returns 0 when the file ended before the block did.
+ */
+int slot_filled( struct slot * slot, ssize_t bytes_read )
+{
+    if ((size_t)bytes_read < slot->length) {
+        slot->length = bytes_read;
+        slot->size = direct ? ROUND_UP(slot->length, DIRECT_ALIGN) : slot->length;
+    }
+    memset(slot->buffer + slot->length, 0, slot->size - slot->length);
+    checksum_block(slot->buffer, slot->length, slot->offset);
+    slot->writing = 1;
+    slot->done = 0;
+    return slot->length > 0;
+}
+
+// copies a range through io_uring, keeping every slot busy
+int copy_uring( int in, int out, off_t offset, off_t length )
+{
+    struct slot slots[ASYNC_DEPTH];
+    struct slot * slot;
+    struct io_uring_cqe cqe;
+    off_t next = offset;
+    off_t end = offset + length;
+    int inflight = 0;
+    int err = 0;
+    int i;
+
+    for (i = 0; i < ASYNC_DEPTH && next < end; i++, inflight++) {
+        slots[i].buffer = async_buffers + (size_t)i * ASYNC_BLOCK;
+        slot_next(&slots[i], &next, end);
+        ring_queue(&ring, IORING_OP_READ, in, slots[i].buffer, slots[i].size, slots[i].offset, i);
+    }
+
+    while (inflight > 0) {
+        if (ring_wait(&ring, &cqe) == -1)
+            return -1; // only a broken ring gets here
+        slot = &slots[cqe.user_data];
+        stat_count(slot->writing ? STAT_WRITE : STAT_READ, 0, cqe.res);
+
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+            ; // the request is queued again below, unchanged
+        else if (cqe.res < 0) {
+            err = -cqe.res;
+            inflight--;
+            continue;
+        }
+        else if (!slot->writing) {
+            if (!err && !slot_read(slot, cqe.res))
+                ; // short of the block, the rest is queued below
+            else if (err || !slot_filled(slot, slot->done)) {
+                next = end; // the source shrank, copy what there was
+                inflight--;
+                continue;
+            }
+        }
+        else {
+            slot->done += cqe.res;
+            if (slot->done == slot->size) {
+                // written, the buffer moves on to the next block
+                if (next >= end || err) {
+                    inflight--;
+                    continue;
+                }
+                slot_next(slot, &next, end);
+            }
+        }
+
+        if (slot->writing)
+            ring_queue(&ring, IORING_OP_WRITE, out, slot->buffer + slot->done,
+                       slot->size - slot->done, slot->offset + slot->done, slot - slots);
+        else
+            ring_queue(&ring, IORING_OP_READ, in, slot->buffer + slot->done,
+                       slot->size - slot->done, slot->offset + slot->done, slot - slots);
+    }
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// reader thread of the fallback, fills slots in order until the range is read
+void * pipeline_reader( void * arg )
+{
+    struct pipeline * pipe = arg;
+    struct slot * slot;
+    ssize_t bytes_read;
+    long long start;
+
+    checksum = pipe->sum;
+
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->count == ASYNC_DEPTH && !pipe->err)
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        if (pipe->err || pipe->next >= pipe->end)
+            break;
+        slot = &pipe->slots[(pipe->head + pipe->count) % ASYNC_DEPTH];
+        pthread_mutex_unlock(&pipe->lock);
+
+        slot_next(slot, &pipe->next, pipe->end);
+        do {
+            start = stat_clock();
+            bytes_read = pread(pipe->in, slot->buffer + slot->done, slot->size - slot->done,
+                               slot->offset + slot->done);
+            stat_count(STAT_READ, start, bytes_read);
+        } while (bytes_read == -1 ? errno == EINTR : !slot_read(slot, bytes_read));
+
+        pthread_mutex_lock(&pipe->lock);
+        if (bytes_read == -1)
+            pipe->err = errno;
+        else if (!slot_filled(slot, slot->done))
+            pipe->next = pipe->end;
+        else
+            pipe->count++;
+        pthread_cond_signal(&pipe->changed);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    pipe->finished = 1;
+    pthread_cond_signal(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+// copies a range with a reader thread filling buffers while this thread writes them
+int copy_threaded( int in, int out, off_t offset, off_t length )
+{
+    struct pipeline pipe;
+    struct slot * slot;
+    pthread_t reader;
+    ssize_t written;
+    long long start;
+    int i;
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.in = in;
+    pipe.sum = checksum;
+    pipe.next = offset;
+    pipe.end = offset + length;
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        pipe.slots[i].buffer = async_buffers + (size_t)i * ASYNC_BLOCK;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.changed, NULL);
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipe) != 0)
+        return -1;
+
+    pthread_mutex_lock(&pipe.lock);
+    for (;;) {
+        while (pipe.count == 0 && !pipe.finished && !pipe.err)
+            pthread_cond_wait(&pipe.changed, &pipe.lock);
+        if (pipe.count == 0 || pipe.err)
+            break;
+        slot = &pipe.slots[pipe.head];
+        pthread_mutex_unlock(&pipe.lock);
+
+        while (slot->done < slot->size) {
+            start = stat_clock();
+            written = pwrite(out, slot->buffer + slot->done, slot->size - slot->done, slot->offset + slot->done);
+            stat_count(STAT_WRITE, start, written);
+            if (written == -1 && errno != EINTR)
+                break;
+            if (written > 0)
+                slot->done += written;
+        }
+
+        pthread_mutex_lock(&pipe.lock);
+        if (slot->done < slot->size && !pipe.err)
+            pipe.err = errno;
+        pipe.head = (pipe.head + 1) % ASYNC_DEPTH;
+        pipe.count--;
+        pthread_cond_signal(&pipe.changed);
+    }
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(reader, NULL);
+
+    if (pipe.err) {
+        errno = pipe.err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies length bytes at offset with several blocks in flight,
+ * through io_uring or else a reader thread. Each thread sets
+ * up its ring and buffers on first use and keeps them.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_async( int in, int out, off_t offset, off_t length )
+{
+    if (!async_buffers
+        && posix_memalign((void **)&async_buffers, DIRECT_ALIGN, (size_t)ASYNC_DEPTH * ASYNC_BLOCK) != 0)
+        return -1;
+    if (ring_state == 0)
+        ring_state = ring_init(&ring, ASYNC_DEPTH) == 0 ? 1 : -1;
+
+    if (ring_state == 1)
+        return copy_uring(in, out, offset, length);
+    return copy_threaded(in, out, offset, length);
+}
+
+// frees what copy_async set up for this thread, before the thread exits
+void async_release( void )
+{
+    free(async_buffers);
+    async_buffers = NULL;
+    if (ring_state == 1) {
+        ring_exit(&ring);
+        ring_state = 0;
+    }
+}
+
+/* Copies length bytes at offset in the source to the same offset
+ * in the copy, or everything up to end of file when length is -1.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_range( int in, int out, off_t offset, off_t length )
+{
+    ssize_t copied;
+    size_t chunk;
+    off_t in_offset;
+    off_t out_offset;
+    long long start;
+
+    if (delta && length > 0)
+        return copy_delta(in, out, offset, length);
+    if (async && length > 0)
+        return copy_async(in, out, offset, length);
 
-    int readerfile = open(argv[1], O_RDONLY, 0);
+    while (length != 0) {
+        chunk = (length < 0 || length > CHUNK_SIZE) ? CHUNK_SIZE : length;
+        in_offset = offset;
+        out_offset = offset;
+
+        if (file_method == COPY_FILE_RANGE && !checksum) {
+            start = stat_clock();
+            copied = copy_file_range(in, &in_offset, out, &out_offset, chunk, 0);
+            stat_count(STAT_KERNEL, start, copied);
+            if (copied == -1 && unsupported(errno)) {
+                file_method = threads > 1 ? COPY_BUFFERED : COPY_SENDFILE;
+                continue;
+            }
+        }
+        else if (file_method == COPY_SENDFILE && !checksum) {
+            // sendfile writes at the copy's file position, so threads cannot share it
+            if (lseek(out, offset, SEEK_SET) == -1)
+                return -1;
+            start = stat_clock();
+            copied = sendfile(out, in, &in_offset, chunk);
+            stat_count(STAT_KERNEL, start, copied);
+            if (copied == -1 && unsupported(errno)) {
+                file_method = COPY_BUFFERED;
+                continue;
+            }
+        }
+        else {
+            copied = copy_buffered(in, out, offset, chunk);
+        }
+
+        if (copied == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (copied == 0)
+            break; // zero bytes == EOF
+
+        offset += copied;
+        if (length > 0)
+            length -= copied;
+    }
+    return 0;
+}
+
+/* Copies the data extents of a regular file lying between
+ * start and end, skipping its holes. Returns 0, or -1 with
+ * errno set.
+ */
+int copy_sparse( int in, int out, off_t start, off_t end )
+{
+    off_t offset = start;
+    off_t data;
+    off_t hole;
+
+    while (offset < end) {
+        data = lseek(in, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            data = end; // only a hole is left
+        else if (data == -1) {
+            if (errno == EINVAL && offset == start)
+                return copy_range(in, out, start, end - start); // a kernel without SEEK_DATA
+            return -1;
+        }
+        if (data > end)
+            data = end;
+        // an old copy may have data where the original has a hole, else compare it against zeros
+        if (delta && data > offset
+            && fallocate(out, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, data - offset) == -1
+            && copy_delta(in, out, offset, data - offset) == -1)
+            return -1;
+        if (data == end)
+            break;
+        hole = lseek(in, data, SEEK_HOLE);
+        if (hole == -1)
+            return -1;
+        if (hole > end)
+            hole = end;
+        if (copy_range(in, out, data, hole - data) == -1)
+            return -1;
+        offset = hole;
+    }
+    return 0;
+}
+
+// thread body for -j, copies ranges until none are left or one fails
+void * copy_worker( void * arg )
+{
+    struct parallel_copy * job = arg;
+    off_t start;
+    off_t end;
+    int no_error = 0;
+
+    checksum = job->sum;
+    delta = job->delta;
+    file_method = job->method;
+
+    while (!__atomic_load_n(&job->err, __ATOMIC_RELAXED)) {
+        start = __atomic_fetch_add(&job->next, RANGE_SIZE, __ATOMIC_RELAXED);
+        if (start >= job->size)
+            break;
+        end = start + RANGE_SIZE < job->size ? start + RANGE_SIZE : job->size;
+        if (copy_sparse(job->in, job->out, start, end) == -1)
+            __atomic_compare_exchange_n(&job->err, &no_error, errno, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    free(copy_buffer);
+    copy_buffer = NULL;
+    async_release();
+    return NULL;
+}
+
+/* Copies a regular file with several threads. The copy gets
+ * its final length first, so the threads never race to extend
+ * it, and a dense copy gets its blocks reserved up front.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_parallel( int in, int out, struct stat * st )
+{
+    struct parallel_copy job = { in, out, st->st_size, 0, 0, checksum, delta, file_method };
+    pthread_t workers[MAX_THREADS];
+    int started;
+
+    if (ftruncate(out, st->st_size) == -1)
+        return -1;
+    if ((off_t)st->st_blocks * 512 >= st->st_size)
+        fallocate(out, 0, 0, st->st_size); // only a hint, failing is fine
+
+    for (started = 0; started < threads; started++)
+        if (pthread_create(&workers[started], NULL, copy_worker, &job) != 0)
+            break;
+    if (started == 0)
+        copy_worker(&job);
+    while (started > 0)
+        pthread_join(workers[--started], NULL);
+
+    if (job.err) {
+        errno = job.err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies the file in to out with -c, from where an earlier
+ * attempt stopped, saving a checkpoint after every step.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_resumable( int in, int out, struct stat * st )
+{
+    off_t offset = progress->offset;
+    off_t end;
+
+    // with -v the part copied before still counts, read it back from the original
+    if (checksum && offset > 0 && checksum_file(in, checksum, offset) == -1)
+        return -1;
+    // the copy gets its length first, so the checkpointed blocks can be read back whole
+    if (ftruncate(out, st->st_size) == -1)
+        return -1;
+
+    for (; offset < st->st_size; offset = end) {
+        end = st->st_size - offset > CHECKPOINT_SIZE ? offset + CHECKPOINT_SIZE : st->st_size;
+        if (copy_sparse(in, out, offset, end) == -1)
+            return -1;
+        if (end < st->st_size && checkpoint_save(progress, st, out, end) == -1)
+            return -1;
+    }
+    return ftruncate(out, st->st_size);
+}
+
+/* Copies everything from in to out, which was just created
+ * or is an old copy to update:
+ * a clone shares the original's blocks and copies nothing,
+ * otherwise copy the bytes, in the kernel when it lets us.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_data( int in, int out, struct stat * st )
+{
+    long long start = stat_clock();
+
+    file_method = copy_method;
+    // procfs and sysfs files claim no size but have content, only reading to the end finds it
+    if (S_ISREG(st->st_mode) && st->st_size == 0) {
+        if (delta && ftruncate(out, 0) == -1)
+            return -1;
+        file_method = COPY_BUFFERED;
+        return copy_range(in, out, 0, -1);
+    }
+    // tried for every file, the next one may be on a filesystem that shares extents
+    if (!checksum && try_clone && ioctl(out, FICLONE, in) == 0) {
+        stat_count(STAT_KERNEL, start, st->st_size);
+        return delta ? ftruncate(out, st->st_size) : 0;
+    }
+    if (!S_ISREG(st->st_mode))
+        return copy_range(in, out, 0, -1);
+    if (progress)
+        return copy_resumable(in, out, st);
+    if (threads > 1 && st->st_size > RANGE_SIZE) {
+        if (copy_parallel(in, out, st) == -1)
+            return -1;
+    }
+    // a dense file has no holes to look for, and its copy ends where the last byte lands
+    else if ((off_t)st->st_blocks * 512 >= st->st_size && !delta && !direct)
+        return copy_range(in, out, 0, st->st_size);
+    else if (copy_sparse(in, out, 0, st->st_size) == -1)
+        return -1;
+    // a trailing hole only exists once the length is set, and -d writes whole blocks past it
+    return ftruncate(out, st->st_size);
+}
+
+/* Copies the file source to copy, which must not exist yet
+ * unless -u is given or -c left a checkpoint for it, and
+ * gives the copy the original's permissions. Returns 0,
+ * 1 when a file cannot be opened, 2 when copying fails and
+ * 3 when -V finds that the copy differs.
+ */
+int copy_file( char * source, char * copy )
+{
+    struct stat stat_struct;
+    struct stat old_copy;
+    struct checksum sum;
+    struct checksum reread;
+    struct checkpoint saved = { -1, 0, 0 };
+    char * checkpoint_path = NULL;
+    int created = 1;
+    int status = 0;
+
+    int readerfile = open(source, O_RDONLY, 0);
     if (readerfile == -1) {
-        perror(argv[1]);
+        perror(source);
         return 1;
     }
-    int outputfile = open(argv[2], O_CREAT|O_EXCL| O_RDONLY | O_RDWR);
+    if (fstat(readerfile, &stat_struct) == -1) {
+        perror("fstat file");
+        close(readerfile);
+        return 1;
+    }
+    if (resumable && S_ISREG(stat_struct.st_mode)) {
+        checkpoint_path = malloc(strlen(copy) + sizeof(".checkpoint"));
+        sprintf(checkpoint_path, "%s.checkpoint", copy);
+        saved.fd = open(checkpoint_path, O_RDWR); // left by an interrupted copy
+    }
+    else if (resumable)
+        fprintf(stderr, "%s: not a regular file, cannot be resumed\n", source);
+
+    int outputfile = open(copy, O_CREAT|O_EXCL|O_RDWR, stat_struct.st_mode & 07777);
+    if (outputfile == -1 && errno == EEXIST && (update || saved.fd != -1)) {
+        created = 0;
+        outputfile = open(copy, S_ISREG(stat_struct.st_mode) ? O_RDWR : O_RDWR|O_TRUNC);
+        // a resumed copy only goes on past its checkpoint, it compares blocks with -u alone
+        delta = update && outputfile != -1 && S_ISREG(stat_struct.st_mode)
+             && fstat(outputfile, &old_copy) == 0 && S_ISREG(old_copy.st_mode)
+             && old_copy.st_size > 0;
+    }
     if (outputfile == -1) {
-        perror(argv[2]);
+        perror(copy);
+        close(readerfile);
+        if (saved.fd != -1)
+            close(saved.fd);
+        free(checkpoint_path);
         return 1;
+    }
+
+    if (checkpoint_path) {
+        if (saved.fd == -1)
+            saved.fd = open(checkpoint_path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+        if (saved.fd == -1) {
+            perror(checkpoint_path);
+            close(readerfile);
+            close(outputfile);
+            free(checkpoint_path);
+            return 1;
+        }
+        saved.offset = checkpoint_load(&saved, &stat_struct, outputfile);
+        if (saved.offset > 0)
+            fprintf(stderr, "%s: resuming at byte %lld\n", copy, (long long)saved.offset);
+        else if (!delta && ftruncate(outputfile, 0) == -1) // holes are only skipped in an empty copy
+            status = error(copy);
+        progress = &saved;
+    }
+
+    // a new copy already has the original's mode, unless the umask took some of it
+    if (!created || (stat_struct.st_mode & creation_mask))
+        fchmod(outputfile, stat_struct.st_mode);
+
+    // O_DIRECT is best effort, filesystems like tmpfs refuse it, and a file claiming no size is read to its end unaligned
+    if (direct && !delta && S_ISREG(stat_struct.st_mode) && stat_struct.st_size > 0) {
+        fcntl(readerfile, F_SETFL, fcntl(readerfile, F_GETFL) | O_DIRECT);
+        fcntl(outputfile, F_SETFL, fcntl(outputfile, F_GETFL) | O_DIRECT);
+    }
+
+    sum.size = reread.size = stat_struct.st_size;
+    sum.crc = reread.crc = 0;
+    if (verify && S_ISREG(stat_struct.st_mode))
+        checksum = &sum;
+    else if (verify)
+        fprintf(stderr, "%s: not a regular file, not checksummed\n", source);
+
+    if (status == 0 && copy_data(readerfile, outputfile, &stat_struct) == -1)
+        status = error(copy);
+
+    if (checksum && status == 0) {
+        checksum = NULL;
+        printf("%08x  %s\n", checksum_value(&sum), source);
+        if (verify == 2) {
+            // push the copy out of the cache, so it is read back from the disk
+            fdatasync(outputfile);
+            posix_fadvise(outputfile, 0, 0, POSIX_FADV_DONTNEED);
+            if (checksum_file(outputfile, &reread, reread.size) == -1)
+                status = error(copy);
+            else if (reread.crc != sum.crc) {
+                fprintf(stderr, "%s: copy does not match %s\n", copy, source);
+                status = 3;
+            }
+        }
+    }
+    checksum = NULL;
+    delta = 0;
+    progress = NULL;
+    if (status == 0 && show_stats)
+        __atomic_add_fetch(&stats.files, 1, __ATOMIC_RELAXED);
+
+    // a finished copy needs no checkpoint, a failed one keeps it to resume from
+    if (checkpoint_path) {
+        close(saved.fd);
+        if (status == 0)
+            unlink(checkpoint_path);
+        free(checkpoint_path);
+    }
+
+    close(readerfile);
+    if (close(outputfile) == -1 && status == 0)
+        status = error(copy);
+    return status;
+}
+
+// queues a new task on the back of thread id's deque
+void push_task( int id, char * from, char * to, int is_dir )
+{
+    struct deque * queue = &pool.queues[id];
+    struct task * task = malloc(sizeof(*task));
+
+    task->from = from;
+    task->to = to;
+    task->is_dir = is_dir;
+    __atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->tasks, queue->tasks + queue->head,
+                    (queue->tail - queue->head) * sizeof(*queue->tasks));
+            queue->tail -= queue->head;
+            queue->head = 0;
         }
+        else {
+            queue->capacity = queue->capacity ? 2 * queue->capacity : 64;
+            queue->tasks = realloc(queue->tasks, queue->capacity * sizeof(*queue->tasks));
+        }
+    }
+    queue->tasks[queue->tail++] = task;
+    pthread_mutex_unlock(&queue->lock);
+
+    // a sleeping thread checks queued under idle_lock, so this wakeup is never lost
+    pthread_mutex_lock(&pool.idle_lock);
+    pool.queued++;
+    pthread_cond_signal(&pool.idle);
+    pthread_mutex_unlock(&pool.idle_lock);
+}
+
+// takes a task from the back of thread id's own deque, or else from the front of another's
+struct task * pop_task( int id )
+{
+    struct deque * queue;
+    struct task * task = NULL;
+    int i;
+
+    for (i = 0; i < pool.workers && !task; i++) {
+        queue = &pool.queues[(id + i) % pool.workers];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail)
+            task = i == 0 ? queue->tasks[--queue->tail] : queue->tasks[queue->head++];
+        if (queue->head == queue->tail)
+            queue->head = queue->tail = 0;
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (task) {
+        pthread_mutex_lock(&pool.idle_lock);
+        pool.queued--;
+        pthread_mutex_unlock(&pool.idle_lock);
+    }
+    return task;
+}
 
+// joins a directory and a name into a new string
+char * join_path( char * dir, char * name )
+{
+    size_t length = strlen(dir);
+    char * path = malloc(length + strlen(name) + 2);
+
+    sprintf(path, "%s%s%s", dir, length && dir[length - 1] == '/' ? "" : "/", name);
+    return path;
+}
+
+// recreates the symbolic link from as to, returns 0 or -1
+int copy_link( char * from, char * to )
+{
+    char target[PATH_MAX];
+    ssize_t length = readlink(from, target, sizeof(target) - 1);
+
+    if (length == -1)
+        return -1;
+    target[length] = '\0';
+    return symlink(target, to);
+}
+
+/* Creates the copy of a directory and queues a task for each
+ * of its entries on thread id's deque. Returns 0, or nonzero
+ * after printing what went wrong.
+ */
+int copy_dir( int id, char * from, char * to )
+{
     struct stat stat_struct;
-    if (stat(argv[1], &stat_struct) == -1) {
-        perror("fstat file");
+    struct dirent * entry;
+    char * child_from;
+    char * child_to;
+    int type;
+    int status = 0;
+
+    DIR * dir = opendir(from);
+    if (!dir || fstat(dirfd(dir), &stat_struct) == -1) {
+        perror(from);
+        if (dir)
+            closedir(dir);
+        return 1;
+    }
+    if (mkdir(to, S_IRWXU) == -1 && !(update && errno == EEXIST)) {
+        perror(to);
+        closedir(dir);
         return 1;
     }
 
+    // the owner must be able to fill the copy, else its mode waits until the end
+    if ((stat_struct.st_mode & S_IRWXU) == S_IRWXU)
+        chmod(to, stat_struct.st_mode & 07777);
+    else {
+        struct late_mode * late = malloc(sizeof(*late));
+        late->path = strdup(to);
+        late->mode = stat_struct.st_mode & 07777;
+        pthread_mutex_lock(&pool.late_lock);
+        late->next = pool.late_modes;
+        pool.late_modes = late;
+        pthread_mutex_unlock(&pool.late_lock);
+    }
 
-    fchmod(outputfile, stat_struct.st_mode);
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        child_from = join_path(from, entry->d_name);
+        child_to = join_path(to, entry->d_name);
 
+        type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat child;
+            type = lstat(child_from, &child) == -1 ? DT_UNKNOWN
+                 : S_ISDIR(child.st_mode) ? DT_DIR
+                 : S_ISREG(child.st_mode) ? DT_REG
+                 : S_ISLNK(child.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
 
-    // reading bytes from original file
-    char buffer[4194304]; // need large buffer to decrease time
-    int bytes_read_in;
-    do {
-        // read one byte at a time
-        bytes_read_in = read(readerfile, buffer, 4194304);
-        if (bytes_read_in > 0) {
-					// writing to copy
-                    write(outputfile, &buffer, bytes_read_in);
+        if (type == DT_DIR || type == DT_REG) {
+            push_task(id, child_from, child_to, type == DT_DIR);
+            continue;
+        }
+        if (type == DT_LNK) {
+            if (update)
+                unlink(child_to); // symlink never replaces a name
+            if (copy_link(child_from, child_to) == -1)
+                status = error(child_to);
+        }
+        else
+            fprintf(stderr, "%s: not a regular file, skipped\n", child_from);
+        free(child_from);
+        free(child_to);
+    }
+
+    closedir(dir);
+    return status;
+}
+
+// body of a pool thread, runs tasks until every task is done
+void * pool_worker( void * arg )
+{
+    int id = (int)(long)arg;
+    struct task * task;
+
+    for (;;) {
+        task = pop_task(id);
+        if (!task) {
+            pthread_mutex_lock(&pool.idle_lock);
+            while (pool.queued <= 0 && __atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) > 0)
+                pthread_cond_wait(&pool.idle, &pool.idle_lock);
+            pthread_mutex_unlock(&pool.idle_lock);
+            if (__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) == 0) {
+                free(copy_buffer);
+                copy_buffer = NULL;
+                async_release();
+                return NULL;
             }
-        } while (bytes_read_in > 0); // zero bytes == EOF
+            continue;
+        }
 
-        if (bytes_read_in == -1)
-            perror("file read");
-		// checks for file reading error
+        if ((task->is_dir ? copy_dir(id, task->from, task->to)
+                          : copy_file(task->from, task->to)) != 0)
+            __atomic_add_fetch(&pool.failures, 1, __ATOMIC_RELAXED);
+        free(task->from);
+        free(task->to);
+        free(task);
 
+        // the last task wakes everyone up to leave
+        if (__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&pool.idle_lock);
+            pthread_cond_broadcast(&pool.idle);
+            pthread_mutex_unlock(&pool.idle_lock);
+        }
+    }
+}
 
-    close(readerfile);
-    close(outputfile);
+// sets up the pool with a thread for each of -j, before tasks are queued
+void pool_init( void )
+{
+    int i;
 
-        return 0;
+    pool.workers = threads;
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle, NULL);
+    pthread_mutex_init(&pool.late_lock, NULL);
+    for (i = 0; i < pool.workers; i++)
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+
+    // -j sized the pool, files are copied by one thread each
+    threads = 1;
+}
+
+/* Runs the pool's threads until every queued task is done.
+ * Returns 0, or 2 if anything failed.
+ */
+int pool_run( void )
+{
+    pthread_t workers[MAX_THREADS];
+    struct late_mode * late;
+    int i;
+
+    for (i = 0; i < pool.workers; i++)
+        if (pthread_create(&workers[i], NULL, pool_worker, (void *)(long)i) != 0)
+            break;
+    if (i == 0)
+        pool_worker(0);
+    while (i > 0)
+        pthread_join(workers[--i], NULL);
+
+    // innermost directories were created last, so they are at the front
+    while ((late = pool.late_modes) != NULL) {
+        if (chmod(late->path, late->mode) == -1)
+            pool.failures += error(late->path);
+        pool.late_modes = late->next;
+        free(late->path);
+        free(late);
     }
+    return pool.failures ? 2 : 0;
+}
+
+/* Copies the directory tree source to copy, which must not
+ * exist yet. Returns 0, or 2 if anything failed.
+ */
+int copy_tree( char * source, char * copy )
+{
+    pool_init();
+    push_task(0, strdup(source), strdup(copy), 1);
+    return pool_run();
+}
+
+/* Copies every file the manifest lists, one original and the
+ * name of its copy per line, separated by a tab. The manifest
+ * is read whole before the pool starts. Returns 0, 1 if the
+ * manifest cannot be opened, or 2 if anything failed.
+ */
+int copy_manifest( char * manifest )
+{
+    FILE * list = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    char * line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    char * tab;
+    long number = 0;
+
+    if (!list) {
+        perror(manifest);
+        return 1;
+    }
+    pool_init();
+    while ((length = getline(&line, &capacity, list)) != -1) {
+        number++;
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+        tab = strchr(line, '\t');
+        if (!tab || tab == line || tab[1] == '\0') {
+            fprintf(stderr, "%s:%ld: expected <file to copy> TAB <name of copy>\n", manifest, number);
+            pool.failures++;
+            continue;
+        }
+        *tab = '\0';
+        push_task(0, strdup(line), strdup(tab + 1), 0);
+    }
+    if (ferror(list))
+        pool.failures += error(manifest);
+    free(line);
+    if (list != stdin)
+        fclose(list);
+    return pool_run();
+}
+
+int main(int argc, char * argv[])
+{
+    int option;
+    int jobs_given = 0;
+    char * manifest = NULL;
+    int status;
+
+    while ((option = getopt(argc, argv, "j:radvVucsb:m:f:")) != -1) {
+        if (option == 'j') {
+            threads = atoi(optarg);
+            if (threads < 1 || threads > MAX_THREADS)
+                return usage(argv[0]);
+            jobs_given = 1;
+        }
+        else if (option == 'r')
+            recursive = 1;
+        else if (option == 'a')
+            async = 1;
+        else if (option == 'd')
+            async = direct = 1;
+        else if (option == 'v')
+            verify = verify ? verify : 1;
+        else if (option == 'V')
+            verify = 2;
+        else if (option == 'u')
+            update = 1;
+        else if (option == 'c')
+            resumable = 1;
+        else if (option == 's')
+            show_stats = 1;
+        else if (option == 'f')
+            manifest = optarg;
+        else if (option == 'b') {
+            buffer_size = parse_size(optarg);
+            if (buffer_size < 512 || buffer_size > (1 << 30))
+                return usage(argv[0]);
+        }
+        else if (option == 'm') {
+            try_clone = 0;
+            if (!strcmp(optarg, "range"))
+                copy_method = COPY_FILE_RANGE;
+            else if (!strcmp(optarg, "sendfile"))
+                copy_method = COPY_SENDFILE;
+            else if (!strcmp(optarg, "read"))
+                copy_method = COPY_BUFFERED;
+            else
+                return usage(argv[0]);
+        }
+        else
+            return usage(argv[0]);
+    }
+    if (argc - optind != (manifest ? 0 : 2) || (manifest && recursive))
+        return usage(argv[0]);
+    if (direct && buffer_size % DIRECT_ALIGN) {
+        fprintf(stderr, "%s: -d needs a -b size that is a multiple of %d\n", argv[0], DIRECT_ALIGN);
+        return 1;
+    }
+    if (verify || resumable)
+        crc_init();
+    stats.start = stat_clock();
+    stats.terminal = isatty(STDERR_FILENO);
+    creation_mask = umask(0);
+    umask(creation_mask);
+
+    if (recursive || manifest) {
+        if (!jobs_given) {
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+        }
+        status = manifest ? copy_manifest(manifest) : copy_tree(argv[optind], argv[optind + 1]);
+    }
+    else
+        status = copy_file(argv[optind], argv[optind + 1]);
+
+    if (show_stats)
+        stat_report();
+    return status;
+}
@@ -0,0 +1,153 @@
+#!/bin/bash
+# mycopy_bench.sh
+# Benchmarks for mycopy.c
+#
+# Usage:
+#   ./mycopy_bench.sh [path to mycopy] [scratch directory]
+#
+# Build mycopy first, e.g. gcc -O2 -pthread -o mycopy mycopy.c
+# The scratch directory defaults to a temporary directory
+# under /tmp and is removed afterwards.
+#
+# Each copy is timed RUNS times and the fastest run counts.
+# The suite runs in the scratch directory and again on tmpfs
+# (TMPFS, /dev/shm unless set empty). Settings, from the
+# environment:
+#   SIZES       file sizes for the strategy table
+#   STRATEGIES  mycopy options to compare, separated by commas
+#   BUFFERS     buffer sizes (-b) for read and write copies
+#   RUNS        runs per measurement
+#   DROP_CACHES set to 1, as root, to start every run with a
+#               cold page cache; otherwise the original is
+#               read from memory, as right after writing it
+
+MYCOPY=$(realpath "${1:-./mycopy}")
+WORK=${2:-$(mktemp -d /tmp/mycopy_bench.XXXXXX)}
+CLEANUP=$([ -z "$2" ] && echo yes)
+
+if [ ! -x "$MYCOPY" ]; then
+    echo "no mycopy binary at $MYCOPY" >&2
+    exit 1
+fi
+mkdir -p "$WORK" || exit 1
+
+SIZES=${SIZES:-"4K 1M 64M 512M"}
+STRATEGIES=${STRATEGIES:-",-m range,-m sendfile,-m read,-a,-d,-j 4"}
+BUFFERS=${BUFFERS:-"16K 64K 256K 1M 4M 16M 64M"}
+RUNS=${RUNS:-3}
+TMPFS=${TMPFS-/dev/shm}
+
+# prints the seconds the given command takes
+seconds() {
+    local start end
+    start=$(date +%s.%N)
+    "$@" || echo "failed: $*" >&2
+    end=$(date +%s.%N)
+    awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }'
+}
+
+# prints the KiB actually allocated to a file
+allocated() {
+    du -k "$1" | cut -f1
+}
+
+# prints the bytes in a size such as 64M
+bytes() {
+    numfmt --from=iec "$1"
+}
+
+# prints the fastest of RUNS copies of $1 to $2 with mycopy
+# options $3, as seconds and MiB/s
+best_copy() {
+    local src=$1 dst=$2 size t best=
+    local -a options
+    read -r -a options <<< "$3"
+    size=$(stat -c %s "$src")
+
+    for _ in $(seq "$RUNS"); do
+        rm -f "$dst"
+        [ "$DROP_CACHES" = 1 ] && sync && echo 3 > /proc/sys/vm/drop_caches
+        t=$(seconds "$MYCOPY" "${options[@]}" "$src" "$dst")
+        best=$(awk -v t="$t" -v b="$best" 'BEGIN { print (b == "" || t < b) ? t : b }')
+    done
+    cmp -s "$src" "$dst" || echo "mycopy $3 output differs from the source" >&2
+    rm -f "$dst"
+    awk -v t="$best" -v s="$size" 'BEGIN { printf "%8.3f s %10.1f MiB/s", t, (t > 0 ? s / 1048576 / t : 0) }'
+}
+
+# strategies: every size in SIZES copied with every strategy in
+# STRATEGIES, in directory $1
+bench_strategies() {
+    local dir=$1 size strategy
+    local -a strategies
+    local src=$dir/strategy.src
+
+    echo "copy strategies in $dir ($(stat -f -c %T "$dir"))"
+    for size in $SIZES; do
+        head -c "$(bytes "$size")" /dev/urandom > "$src"
+        sync
+        IFS=, read -r -a strategies <<< "$STRATEGIES"
+        for strategy in "${strategies[@]}"; do
+            printf "  %-6s %-12s %s\n" "$size" "${strategy:-default}" \
+                "$(best_copy "$src" "$dir/strategy.copy" "$strategy")"
+        done
+    done
+    rm -f "$src"
+}
+
+# buffers: the largest of SIZES copied with read and write
+# through every buffer size in BUFFERS, in directory $1
+bench_buffers() {
+    local dir=$1 buffer
+    local size=${SIZES##* }
+    local src=$dir/buffer.src
+
+    echo "buffer sizes for a $size file in $dir ($(stat -f -c %T "$dir"))"
+    head -c "$(bytes "$size")" /dev/urandom > "$src"
+    sync
+    for buffer in $BUFFERS; do
+        printf "  %-6s %s\n" "$buffer" "$(best_copy "$src" "$dir/buffer.copy" "-m read -b $buffer")"
+    done
+    rm -f "$src"
+}
+
+# sparse: a 4 GiB file holding 16 MiB of data in 1 MiB extents,
+# copied by mycopy and by a plain byte-for-byte copy
+bench_sparse() {
+    local src=$WORK/sparse.img
+    local i t
+
+    rm -f "$src" "$WORK"/sparse.*
+    truncate -s 4G "$src"
+    for i in $(seq 0 15); do
+        head -c 1048576 /dev/urandom |
+            dd of="$src" bs=1M seek=$((i * 256)) conv=notrunc status=none
+    done
+    sync
+
+    echo "sparse 4 GiB file, 16 MiB of data"
+    printf "  %-10s %8s s %10s KiB allocated\n" source - "$(allocated "$src")"
+
+    t=$(seconds "$MYCOPY" "$src" "$WORK/sparse.mycopy")
+    printf "  %-10s %8s s %10s KiB allocated\n" mycopy "$t" "$(allocated "$WORK/sparse.mycopy")"
+
+    t=$(seconds sh -c 'cat "$1" > "$2"' sh "$src" "$WORK/sparse.dense")
+    printf "  %-10s %8s s %10s KiB allocated\n" cat "$t" "$(allocated "$WORK/sparse.dense")"
+
+    cmp -s "$src" "$WORK/sparse.mycopy" || echo "  mycopy output differs from the source" >&2
+    rm -f "$src" "$WORK"/sparse.*
+}
+
+bench_sparse
+bench_strategies "$WORK"
+bench_buffers "$WORK"
+
+if [ -n "$TMPFS" ] && [ -w "$TMPFS" ]; then
+    SHM=$(mktemp -d "$TMPFS/mycopy_bench.XXXXXX")
+    bench_strategies "$SHM"
+    bench_buffers "$SHM"
+    rm -rf "$SHM"
+fi
+
+[ -n "$CLEANUP" ] && rm -rf "$WORK"
+exit 0
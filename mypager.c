@@ -9,6 +9,28 @@
  * The user controls the output by pressing keys, as follows:
  * 'f': forwards to the next page
  * 'q': quits
+ * A regular file is mapped into memory and indexed first, which
+ * allows moving around it as well:
+ * 'b': backwards to the previous page
+ * 'g': to the top, or with a number typed before it, to that line
+ * 'G': to the last page, or with a number, to that line
+ * '%': with a number typed before it, that far into the file
+ * The index samples where every ROW_SAMPLE-th row (a line as it
+ * is displayed, wrapped by the rule of fetch_next_line()) and
+ * every LINE_SAMPLE-th line start, so any page is found by
+ * walking fewer than ROW_SAMPLE rows from a sample.
+ * A thread builds the index while the first page is shown, so
+ * that it appears at once however large the file is. Paging
+ * uses the part of the index that is ready, and a jump past it
+ * waits for the thread, showing its progress. Build with
+ * -pthread.
+ * Lines are found by scan_row(), which compares 16 bytes at a
+ * time with SSE2 on x86-64 and one at a time elsewhere. (AVX2
+ * was slower: a row is at most 81 bytes, too short for 32-byte
+ * vectors to pay off.) Files that cannot be mapped, like pipes,
+ * are read into a buffer BUFFER_SIZE bytes at a time.
+ * "mypager -b <filename>" measures how fast each way reads the
+ * file.
  * NOTE: Each keypress is read immediately; the user does not
  * press the Enter key. To learn how immediate input mode is
  * effectuated, see the eliminate_stdio_buffering() function
@@ -20,18 +42,45 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <termios.h>
+#include <errno.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
 // preprocessor definitions
 #define PAGE_SIZE 20
 #define LINE_WIDTH 80
 #define BUFFER_SIZE ((LINE_WIDTH + 1) * PAGE_SIZE)
+#define ROW_SAMPLE 64 // the index keeps the offset of every ROW_SAMPLE-th row
+#define LINE_SAMPLE 64 // and the first row of every LINE_SAMPLE-th line
+#define INDEX_BATCH 4096 // the indexing thread publishes its progress after this many rows
 
 // forward declarations
 void display_page();
 int fetch_next_line( char line[] );
-int fetch_next_word( char word[], int max_size );
 int refill_buffer( int start );
+int scan_row_scalar( const char * text, int length, int * space );
+#if defined(__x86_64__)
+int scan_row_sse2( const char * text, int length, int * space );
+#endif
+int benchmark( char * name );
+
+int map_file();
+void * build_index( void * unused );
+int index_percent();
+void wait_for_index( size_t lines, off_t offset );
+off_t next_row( off_t start, off_t * end );
+off_t walk_rows( off_t offset, size_t rows );
+off_t row_offset( size_t row );
+size_t line_row( size_t line );
+size_t offset_row( off_t offset );
+void display_rows( off_t offset );
+void page_mapped();
 
 void eliminate_stdio_buffering();
 void restore_stdio_buffering();
@@ -40,12 +89,32 @@ void restore_stdio_buffering();
 int fd;
 char buffer[BUFFER_SIZE]; 
 int buffer_position = 0;
+int buffer_length = 0; // bytes in the buffer, those from buffer_position on are unread
+int read_size = BUFFER_SIZE; // at most this much is read at once, 1 to measure the old way
+#if defined(__x86_64__)
+int (*scan_row)( const char * text, int length, int * space ) = scan_row_sse2;
+#else
+int (*scan_row)( const char * text, int length, int * space ) = scan_row_scalar;
+#endif
 struct termios old, new;
 
+// the file mapped into memory, and its index
+char * map;
+off_t map_size;
+struct index {
+	off_t * row_offsets; // offsets of rows 0, ROW_SAMPLE, 2 * ROW_SAMPLE, ...
+	size_t * line_rows; // first rows of lines 0, LINE_SAMPLE, 2 * LINE_SAMPLE, ...
+	size_t rows; // rows indexed so far, all of the file's once done is set
+	size_t lines; // lines indexed so far
+	off_t indexed; // bytes indexed so far
+	int done;
+} file_index; // the indexing thread writes it, the pager reads the part published
+
 int usage( char * name )
 {
 	fprintf( stderr, "Usage:\n" );
 	fprintf( stderr, "%s <filename>\n", name );
+	fprintf( stderr, "%s -b <filename>   to measure reading it\n", name );
 	return 1;
 }
 
@@ -59,7 +128,7 @@ void display_page()
 {
 	int number_of_chars;
 	int number_of_lines;
-	char line[LINE_WIDTH];
+	char line[LINE_WIDTH + 1];
 	int i;
 	for( number_of_lines= 0; number_of_lines < PAGE_SIZE;
 	 number_of_lines++ )
@@ -85,92 +154,69 @@ void display_page()
 }
 
 /* int fetch_next_line( char line[] )
- * Retrieves the next line of text from the buffer by
- * repeatedly calling fetch_next_word().
+ * Retrieves the next line of text from the buffer, refilling
+ * the buffer first when it holds less than a whole line.
  * Each line breaks at either:
  * a) a LF ('\n') character, or
  * b) the last whitespace encountered at a position that is
  * <= (LINE_WIDTH + 1) (Why? Because if a line can contain 80
  * characters, but the last space between words occurs at
  * character 81, then the line can be broken at character 81.)
- * The line of text is stored in the line parameter.
- * Returns: the number of characters in the line, or -1 if
- * an error occurred.
+ * or, when a word is longer than LINE_WIDTH, after LINE_WIDTH
+ * characters. The LF is kept in the line, the whitespace a
+ * line breaks at is not. scan_row() finds both in one pass.
+ * The line of text is stored in the line parameter, which
+ * must hold LINE_WIDTH + 1 characters.
+ * Returns: the number of characters in the line, 0 at the EOF,
+ * or -1 if an error occurred.
  */
 
 int fetch_next_line( char line[] )
 {
-	//break each line at LFchar or last space which is <= (LINE_WIDTH + 1)
-     
-        int newline = 0;
-        newline = fetch_next_word(line, 81);
-		//the last space between words occurs at character 81, then the line can be broken at character 81.
-        if (newline >= 0)
-        { // this means theres a word avaliable to be put on the line
-            return newline;
-        }
-        else
-        {// returns -1 if error occurs and byte count is somehow -1
-            return -1;
-        }
-}
-
-/* int fetch_next_word( char word[], int max_size )
- * Reads bytes from the buffer until the next word is found.
- * Punctuation marks count as word characters; thus, the period
- * at the end of a sentence is included with the last word.
- * If the size of the word, plus trailing whitespace characters,
- * is <= (max_size + 1)
- *    copy the word to the buffer and return the number of chars
- * else
- *    return an error code
- * If the end of the buffer is reached while trying to determine
- * the next word, this function moves the remaining contents to
- * the beginning of the buffer and calls refill_buffer() to 
- * refill the remainder of the buffer.
- * Returns: the number of bytes in the word if successful;
- * otherwise, returns the following error values:
- *    0 if the EOF is reached;
- *   -1 if an error occurs; or
- *   -2 if the word length exceeds the max_size parameter.
- */
- 
-int fetch_next_word( char word[], int max_size )
-{	
-	int wdfill = 0; // how many characters on the current line
-	int re;
-	while (wdfill < max_size) {
-		// max size is number of characters that can fit into the word
-		 if (buffer[0] != '\n'){
-			word[wdfill] = buffer[0];
-			re = refill_buffer(0);
-			// reseting buffer and returns value to re (how many bytes in it)
-			wdfill++;
-			if (re == 0) {
-			return 0;
-			}
-		} else {
-			refill_buffer(0);
-			//refill the remainder of the buffer.
-			return wdfill;
+	int available= buffer_length - buffer_position;
+	int newline;
+	int space;
+	int length;
+	int consumed;
+	int bytes_read;
+
+	if ( available <= LINE_WIDTH )
+	{
+		// move the rest to the beginning of the buffer and refill the remainder
+		memmove( buffer, buffer + buffer_position, available );
+		buffer_position= 0;
+		buffer_length= available;
+		while ( buffer_length <= LINE_WIDTH )
+		{
+			bytes_read= refill_buffer( buffer_length );
+			if ( bytes_read == -1 )
+				return -1;
+			if ( bytes_read == 0 )
+				break;
+			buffer_length+= bytes_read;
 		}
+		available= buffer_length;
 	}
-	// error checks
-	if (wdfill > max_size) { //-2 if the word length exceeds the max_size parameter.
-		return -2;
-	}
-	if (wdfill < 0) { // if bytes remain is -1 theres an error
-		return -1;
-	}
-	if (wdfill == 0){ //0 if the EOF is reached;
+	if ( available == 0 )
 		return 0;
-	} else {
-		return wdfill; //returns remaining count
+
+	newline= scan_row( buffer + buffer_position, available > LINE_WIDTH ? LINE_WIDTH + 1 : available, &space );
+	if ( newline >= 0 )
+		length= consumed= newline + 1;
+	else if ( available <= LINE_WIDTH ) // the rest of the file fits
+		length= consumed= available;
+	else if ( space > 0 )
+	{
+		length= space;
+		consumed= space + 1;
 	}
-	
-	
-}
+	else
+		length= consumed= LINE_WIDTH;
 
+	memcpy( line, buffer + buffer_position, length );
+	buffer_position+= consumed;
+	return length;
+}
 
 /* int refill_buffer( int start )
  * Refills the buffer, starting at the buffer index designated by the
@@ -182,15 +228,524 @@ int fetch_next_word( char word[], int max_size )
 int refill_buffer( int start )
 {
     int bytes_r = 0;
+    int size = BUFFER_SIZE - start < read_size ? BUFFER_SIZE - start : read_size;
 	// refills the buffer starting at the indicated buffer index
-    bytes_r = read( fd, buffer + start, 1 );
+    do
+        bytes_r = read( fd, buffer + start, size );
+    while ( bytes_r == -1 && errno == EINTR );
     if(bytes_r == -1) 
     { // returns the error value from call to read 
         perror("file read");
     }
-    else {
-        return bytes_r; // return number of bytes read
-    }
+    return bytes_r; // return number of bytes read
+}
+
+/* int scan_row_scalar( const char * text, int length, int * space )
+ * Looks through the first length characters of text, one at a
+ * time, for the first LF and for the whitespace (' ' or '\t')
+ * a row would break at.
+ * Returns: the index of the first LF, or -1 if there is none,
+ * in which case *space holds the index of the last whitespace,
+ * or -1 if there is none either.
+ */
+
+int scan_row_scalar( const char * text, int length, int * space )
+{
+	int i;
+
+	*space= -1;
+	for ( i= 0; i < length; i++ )
+	{
+		if ( text[i] == '\n' )
+			return i;
+		if ( text[i] == ' ' || text[i] == '\t' )
+			*space= i;
+	}
+	return -1;
+}
+
+#if defined(__x86_64__)
+/* int scan_row_sse2( const char * text, int length, int * space )
+ * Does what scan_row_scalar() does, comparing 16 characters at
+ * a time. Every x86-64 CPU has SSE2.
+ */
+
+int scan_row_sse2( const char * text, int length, int * space )
+{
+	__m128i newline= _mm_set1_epi8( '\n' );
+	__m128i blank= _mm_set1_epi8( ' ' );
+	__m128i tab= _mm_set1_epi8( '\t' );
+	__m128i chunk;
+	unsigned newlines;
+	unsigned blanks;
+	int tail_space;
+	int tail;
+	int i;
+
+	*space= -1;
+	for ( i= 0; i + 16 <= length; i+= 16 )
+	{
+		chunk= _mm_loadu_si128( (const __m128i *)( text + i ) );
+		newlines= _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, newline ) );
+		if ( newlines != 0 )
+			return i + __builtin_ctz( newlines );
+		blanks= _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, blank ),
+			_mm_cmpeq_epi8( chunk, tab ) ) );
+		if ( blanks != 0 )
+			*space= i + 31 - __builtin_clz( blanks );
+	}
+	// the tail is shorter than a vector, and reading past length could leave the file's mapping
+	tail= scan_row_scalar( text + i, length - i, &tail_space );
+	if ( tail_space >= 0 )
+		*space= i + tail_space;
+	return tail >= 0 ? i + tail : -1;
+}
+#endif
+
+/* int map_file()
+ * Maps the whole file into memory and sets aside room for its
+ * index. The index can hold a row for every byte of the file,
+ * which is the most there can be; its pages only take memory
+ * once they are written.
+ * Returns: 0 if successful; otherwise -1, for files that
+ * cannot be mapped, like pipes or empty files.
+ */
+
+int map_file()
+{
+	struct stat st;
+	size_t samples;
+
+	if ( fstat( fd, &st ) == -1 || !S_ISREG( st.st_mode ) || st.st_size == 0 )
+		return -1;
+	map= mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if ( map == MAP_FAILED )
+		return -1;
+	map_size= st.st_size;
+
+	samples= map_size / ROW_SAMPLE + 2;
+	file_index.row_offsets= mmap( NULL, samples * sizeof(off_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	samples= map_size / LINE_SAMPLE + 2;
+	file_index.line_rows= mmap( NULL, samples * sizeof(size_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if ( file_index.row_offsets == MAP_FAILED || file_index.line_rows == MAP_FAILED )
+	{
+		munmap( map, map_size );
+		return -1;
+	}
+	return 0;
+}
+
+/* off_t next_row( off_t start, off_t * end )
+ * Finds where the row that begins at offset start breaks, by
+ * the rule of fetch_next_line(): at a LF, or else at the last
+ * whitespace within LINE_WIDTH + 1 characters, or else after
+ * LINE_WIDTH characters when a word is longer than that.
+ * The text of the row ends at *end, without the LF or space.
+ * Returns: the offset of the next row.
+ */
+
+off_t next_row( off_t start, off_t * end )
+{
+	int space;
+	int newline= scan_row( map + start, map_size - start > LINE_WIDTH ? LINE_WIDTH + 1 : map_size - start, &space );
+
+	if ( newline >= 0 )
+	{
+		*end= start + newline;
+		return *end + 1;
+	}
+	if ( map_size - start <= LINE_WIDTH ) // the rest of the file fits
+	{
+		*end= map_size;
+		return map_size;
+	}
+	if ( space > 0 )
+	{
+		*end= start + space;
+		return *end + 1;
+	}
+	*end= start + LINE_WIDTH;
+	return *end;
+}
+
+/* void * build_index( void * unused )
+ * Body of the indexing thread. Walks the mapped file row by
+ * row, counting its rows and lines and sampling where they
+ * begin, and publishes its progress every INDEX_BATCH rows so
+ * that the pager can use the part of the index that is ready.
+ */
+
+void * build_index( void * unused )
+{
+	off_t offset= 0;
+	off_t end;
+	size_t rows= 0;
+	size_t lines= 0;
+
+	while ( offset < map_size )
+	{
+		if ( rows % ROW_SAMPLE == 0 )
+			file_index.row_offsets[rows / ROW_SAMPLE]= offset;
+		if ( offset == 0 || map[offset - 1] == '\n' )
+		{
+			if ( lines % LINE_SAMPLE == 0 )
+				file_index.line_rows[lines / LINE_SAMPLE]= rows;
+			lines++;
+		}
+		rows++;
+		offset= next_row( offset, &end );
+
+		if ( rows % INDEX_BATCH == 0 )
+		{
+			// the samples are written before the counts that cover them
+			__atomic_store_n( &file_index.lines, lines, __ATOMIC_RELEASE );
+			__atomic_store_n( &file_index.rows, rows, __ATOMIC_RELEASE );
+			__atomic_store_n( &file_index.indexed, offset, __ATOMIC_RELEASE );
+		}
+	}
+	__atomic_store_n( &file_index.lines, lines, __ATOMIC_RELEASE );
+	__atomic_store_n( &file_index.rows, rows, __ATOMIC_RELEASE );
+	__atomic_store_n( &file_index.indexed, map_size, __ATOMIC_RELEASE );
+	__atomic_store_n( &file_index.done, 1, __ATOMIC_RELEASE );
+	return unused;
+}
+
+/* int index_percent()
+ * Returns: how much of the file has been indexed, in percent.
+ */
+
+int index_percent()
+{
+	return __atomic_load_n( &file_index.indexed, __ATOMIC_ACQUIRE ) * 100 / map_size;
+}
+
+/* void wait_for_index( size_t lines, off_t offset )
+ * Waits until the index covers the given number of lines and
+ * the bytes before the given offset, or the whole file, and
+ * shows how far indexing has come meanwhile.
+ */
+
+void wait_for_index( size_t lines, off_t offset )
+{
+	int waited= 0;
+
+	while ( !__atomic_load_n( &file_index.done, __ATOMIC_ACQUIRE )
+		&& ( __atomic_load_n( &file_index.lines, __ATOMIC_ACQUIRE ) < lines
+		|| __atomic_load_n( &file_index.indexed, __ATOMIC_ACQUIRE ) <= offset ) )
+	{
+		printf( "\r(indexing: %d%%)", index_percent() );
+		fflush( stdout );
+		waited= 1;
+		usleep( 100000 );
+	}
+	if ( waited )
+		printf( "\n" );
+}
+
+/* off_t walk_rows( off_t offset, size_t rows )
+ * Returns: the offset of the row the given number of rows
+ * after the one at offset, or the size of the file if it
+ * ends first.
+ */
+
+off_t walk_rows( off_t offset, size_t rows )
+{
+	off_t end;
+
+	for ( ; rows > 0 && offset < map_size; rows-- )
+		offset= next_row( offset, &end );
+	return offset;
+}
+
+/* off_t row_offset( size_t row )
+ * Returns: the offset where the given row begins, found from
+ * the nearest sample before it that is indexed yet.
+ */
+
+off_t row_offset( size_t row )
+{
+	size_t samples= ( __atomic_load_n( &file_index.rows, __ATOMIC_ACQUIRE ) + ROW_SAMPLE - 1 ) / ROW_SAMPLE;
+	size_t sample= row / ROW_SAMPLE;
+
+	if ( samples == 0 ) // nothing is published yet, but row 0 starts at offset 0
+		return walk_rows( 0, row );
+	if ( sample >= samples )
+		sample= samples - 1;
+	return walk_rows( file_index.row_offsets[sample], row - sample * ROW_SAMPLE );
+}
+
+/* size_t line_row( size_t line )
+ * Returns: the first row of the given line, counting from 0,
+ * which must be indexed already.
+ */
+
+size_t line_row( size_t line )
+{
+	size_t row= file_index.line_rows[line / LINE_SAMPLE];
+	size_t lines_left= line % LINE_SAMPLE;
+	off_t offset= row_offset( row );
+	off_t end;
+
+	while ( lines_left > 0 )
+	{
+		offset= next_row( offset, &end );
+		row++;
+		if ( map[offset - 1] == '\n' ) // that row ended its line
+			lines_left--;
+	}
+	return row;
+}
+
+/* size_t offset_row( off_t offset )
+ * Returns: the row that holds the byte at the given offset,
+ * found by a binary search of the row samples indexed yet.
+ */
+
+size_t offset_row( off_t offset )
+{
+	size_t low= 0;
+	size_t high= ( __atomic_load_n( &file_index.rows, __ATOMIC_ACQUIRE ) + ROW_SAMPLE - 1 ) / ROW_SAMPLE;
+	size_t middle;
+	size_t row;
+	off_t start;
+	off_t next;
+	off_t end;
+
+	while ( high - low > 1 ) // the sample before offset is in [low, high)
+	{
+		middle= low + ( high - low ) / 2;
+		if ( file_index.row_offsets[middle] <= offset )
+			low= middle;
+		else
+			high= middle;
+	}
+	row= low * ROW_SAMPLE;
+	start= high > 0 ? file_index.row_offsets[low] : 0;
+	while ( ( next= next_row( start, &end ) ) <= offset && next < map_size )
+	{
+		start= next;
+		row++;
+	}
+	return row;
+}
+
+/* void display_rows( off_t offset )
+ * Prints the page of rows that begins at the given offset and,
+ * while the index is still being built, how far it has come.
+ */
+
+void display_rows( off_t offset )
+{
+	off_t next;
+	off_t end;
+	int row;
+
+	for( row= 0; row < PAGE_SIZE; row++ )
+	{
+		if ( offset >= map_size )
+		{
+			printf( "=== EOF ===\n" );
+			break;
+		}
+		next= next_row( offset, &end );
+		fwrite( map + offset, sizeof(char), end - offset, stdout );
+		printf( "\n" );
+		offset= next;
+	}
+	if ( !__atomic_load_n( &file_index.done, __ATOMIC_ACQUIRE ) )
+		printf( "(indexing: %d%%)\n", index_percent() );
+}
+
+/* void page_mapped()
+ * Reads commands and displays pages of the mapped file until
+ * the user quits. Digits typed before a command make up its
+ * number. Paging needs no index; a jump waits until the index
+ * reaches the place it goes to.
+ */
+
+void page_mapped()
+{
+	size_t top= 0; // the row at the top of the page
+	off_t top_offset= 0;
+	size_t last;
+	size_t lines;
+	size_t number= 0;
+	int numbered= 0;
+	int command;
+	off_t target;
+
+	display_rows( top_offset );
+	while ( ( command= getchar() ) != 'q' && command != EOF )
+	{
+		if ( command >= '0' && command <= '9' )
+		{
+			number= number * 10 + ( command - '0' );
+			numbered= 1;
+			continue;
+		}
+		switch( command )
+		{
+		case 'f':
+		case ' ':
+			target= walk_rows( top_offset, PAGE_SIZE );
+			if ( target < map_size )
+			{
+				top+= PAGE_SIZE;
+				top_offset= target;
+			}
+			break;
+		case 'b':
+			top= top > PAGE_SIZE ? top - PAGE_SIZE : 0;
+			top_offset= row_offset( top );
+			break;
+		case 'g':
+		case 'G':
+			if ( numbered && number > 0 )
+			{
+				wait_for_index( number, 0 );
+				lines= __atomic_load_n( &file_index.lines, __ATOMIC_ACQUIRE );
+				number= number > lines ? lines : number;
+				top= line_row( number - 1 );
+			}
+			else if ( command == 'g' )
+				top= 0;
+			else
+			{
+				wait_for_index( 0, map_size );
+				top= file_index.rows > PAGE_SIZE ? file_index.rows - PAGE_SIZE : 0;
+			}
+			top_offset= row_offset( top );
+			break;
+		case '%':
+			number= number > 100 ? 100 : number;
+			target= map_size / 100 * number + map_size % 100 * number / 100;
+			wait_for_index( 0, target );
+			top= offset_row( target );
+			if ( __atomic_load_n( &file_index.done, __ATOMIC_ACQUIRE ) ) // only then is the last page known
+			{
+				last= file_index.rows > PAGE_SIZE ? file_index.rows - PAGE_SIZE : 0;
+				top= top > last ? last : top;
+			}
+			top_offset= row_offset( top );
+			break;
+		default:
+			numbered= 0;
+			number= 0;
+			continue;
+		}
+		display_rows( top_offset );
+		numbered= 0;
+		number= 0;
+	}
+}
+
+/* double seconds_since( struct timespec * start )
+ * Returns: the seconds that have passed since start.
+ */
+
+double seconds_since( struct timespec * start )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return ( now.tv_sec - start->tv_sec ) + ( now.tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+/* void benchmark_stream( char * label, off_t limit )
+ * Reads the file from the start with fetch_next_line(), as the
+ * pager does for files that cannot be mapped, until limit bytes
+ * have been read or the file ends, and prints how fast it went.
+ */
+
+void benchmark_stream( char * label, off_t limit )
+{
+	char line[LINE_WIDTH + 1];
+	struct timespec start;
+	off_t bytes;
+	size_t rows= 0;
+	double seconds;
+
+	lseek( fd, 0, SEEK_SET );
+	buffer_position= buffer_length= 0;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	do
+		bytes= lseek( fd, 0, SEEK_CUR ) - ( buffer_length - buffer_position );
+	while ( bytes < limit && fetch_next_line( line ) > 0 && ++rows );
+	seconds= seconds_since( &start );
+	printf( "%-24s %12lld bytes %10zu rows %10.1f MB/s\n", label, (long long) bytes, rows,
+		bytes / 1e6 / seconds );
+}
+
+/* void benchmark_index( char * label )
+ * Indexes the whole mapped file with build_index(), as the
+ * indexing thread does, and prints how fast it went.
+ */
+
+void benchmark_index( char * label )
+{
+	struct timespec start;
+	double seconds;
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	build_index( NULL );
+	seconds= seconds_since( &start );
+	printf( "%-24s %12lld bytes %10zu rows %10.1f MB/s\n", label, (long long) map_size,
+		file_index.rows, map_size / 1e6 / seconds );
+}
+
+/* int benchmark( char * name )
+ * Measures how fast the named file can be split into rows: read
+ * a byte at a time and scanned a byte at a time, as the pager
+ * used to, then read a buffer at a time and, if the file can be
+ * mapped, indexed, with each version of scan_row(). The
+ * byte-at-a-time read stops after 16 MiB.
+ * Returns: the exit status for main().
+ */
+
+int benchmark( char * name )
+{
+	int (*best)( const char * text, int length, int * space )= scan_row;
+	int (*scanners[2])( const char * text, int length, int * space )= { scan_row_scalar };
+	char * labels[2]= { "scalar" };
+	char label[64];
+	int count= 1;
+	int i;
+
+#if defined(__x86_64__)
+	scanners[count]= scan_row_sse2;
+	labels[count++]= "sse2";
+#endif
+	fd= open( name, O_RDONLY );
+	if ( fd == -1 )
+	{
+		perror( "open() failed" );
+		return 1;
+	}
+
+	read_size= 1;
+	scan_row= scan_row_scalar;
+	benchmark_stream( "read 1, scalar", 16 << 20 );
+	read_size= BUFFER_SIZE;
+	for ( i= 0; i < count; i++ )
+	{
+		scan_row= scanners[i];
+		snprintf( label, sizeof label, "read %d, %s", BUFFER_SIZE, labels[i] );
+		benchmark_stream( label, (off_t) 1 << 62 );
+	}
+	if ( map_file() == 0 )
+	{
+		for ( i= 0; i < count; i++ )
+		{
+			scan_row= scanners[i];
+			snprintf( label, sizeof label, "index, %s", labels[i] );
+			benchmark_index( label );
+		}
+	}
+	scan_row= best;
+	close( fd );
+	return 0;
 }
 
 int main( int argc, char * argv[] )
@@ -201,6 +756,8 @@ int main( int argc, char * argv[] )
 	//  f   forward (next page)
 	//  q   quit
 	
+	if ( argc == 3 && strcmp( argv[1], "-b" ) == 0 )
+		return benchmark( argv[2] );
 	if ( argc != 2 )
 		return usage( argv[0] );
 		
@@ -211,8 +768,20 @@ int main( int argc, char * argv[] )
 		perror( "open() failed" );
 		return 1;
 	}
-	
-	refill_buffer( 0 );
+
+	if ( map_file() == 0 )
+	{
+		pthread_t indexer;
+		if ( pthread_create( &indexer, NULL, build_index, NULL ) == 0 )
+			pthread_detach( indexer ); // quitting does not wait for it
+		else
+			build_index( NULL );
+		eliminate_stdio_buffering();
+		page_mapped();
+		close( fd );
+		restore_stdio_buffering();
+		return 0;
+	}
 	
 	// set up the terminal to eliminate buffering for stdio
 	eliminate_stdio_buffering();